@@ -48,6 +48,20 @@ struct OpenFile opentab[MAXOPEN] = {
 // Virtual address at which to receive page mappings containing client requests.
 union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
 
+// Request channels shared with clients (see struct Fschan), each on
+// its own page in [FSCHANVA, FSCHANVA + MAXCHAN * PGSIZE).  The first
+// nchan entries of chantab are in use, so only those are scanned.
+#define MAXCHAN		64
+#define FSCHANVA	0x0ff00000
+
+struct Chan {
+	envid_t c_envid;	// Client
+	struct Fschan *c_ch;	// Shared channel page
+};
+
+struct Chan chantab[MAXCHAN];
+int nchan;
+
 void
 serve_init(void)
 {
@@ -58,6 +72,8 @@ serve_init(void)
 		opentab[i].o_fd = (struct Fd*) va;
 		va += PGSIZE;
 	}
+	for (i = 0; i < MAXCHAN; i++)
+		chantab[i].c_ch = (struct Fschan *) (FSCHANVA + i * PGSIZE);
 }
 
 // Allocate an open file.
@@ -311,6 +327,146 @@ serve_sync(envid_t envid, union Fsipc *req)
 
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
+// Share the channel page the client sent with FSREQ_CHANNEL; from
+// now on its reads and writes arrive through the channel.  A client
+// that sets up a new channel replaces its old one.
+int
+serve_channel(envid_t envid, union Fsipc *req)
+{
+	struct Chan *c;
+	int r;
+
+	if (debug)
+		cprintf("serve_channel %08x\n", envid);
+
+	for (c = chantab; c < chantab + nchan; c++)
+		if (c->c_envid == envid)
+			break;
+	if (c == chantab + MAXCHAN)
+		return -E_MAX_OPEN;
+	if ((r = sys_page_map(0, req, 0, c->c_ch, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	if (c == chantab + nchan)
+		nchan++;
+	c->c_envid = envid;
+	return 0;
+}
+
+// Nothing to do: the channels are drained before we block again, and
+// the reply goes out after that.
+int
+serve_doorbell(envid_t envid, union Fsipc *req)
+{
+	return 0;
+}
+
+// Carry out one channel request, with 'buf' as its data buffer.
+static int
+serve_chan_req(envid_t envid, struct Fschan_sqe *sqe, char *buf)
+{
+	struct OpenFile *o;
+	size_t n;
+	int r;
+
+	if ((r = openfile_lookup(envid, sqe->sqe_fileid, &o)) < 0)
+		return r;
+	n = MIN(sqe->sqe_n, FSCHAN_DATASIZE);
+	switch (sqe->sqe_type) {
+	case FSREQ_READ:
+		r = file_read(o->o_file, buf, n, o->o_fd->fd_offset);
+		break;
+	case FSREQ_WRITE:
+		r = file_write(o->o_file, buf, n, o->o_fd->fd_offset);
+		break;
+	default:
+		return -E_INVAL;
+	}
+	if (r > 0)
+		o->o_fd->fd_offset += r;
+	return r;
+}
+
+// Handle every request posted on channel 'c' so far.
+// Returns the number of requests handled.
+static int
+chan_drain(struct Chan *c)
+{
+	struct Fschan *ch = c->c_ch;
+	struct Fschan_sqe *sqe;
+	uint32_t i;
+	int n = 0, r, broken = 0;
+
+	// Don't trust a client that posted more than the ring holds.
+	if (ch->ch_sq_prod - ch->ch_cq_prod > FSCHAN_NSLOT)
+		ch->ch_sq_prod = ch->ch_cq_prod;
+
+	while (ch->ch_cq_prod != ch->ch_sq_prod) {
+		i = ch->ch_cq_prod % FSCHAN_NSLOT;
+		sqe = &ch->ch_sq[i];
+		if (sqe->sqe_linked && broken)
+			r = 0;
+		else
+			r = serve_chan_req(c->c_envid, sqe, ch->ch_data[i]);
+		broken = r < 0 || r < (int) MIN(sqe->sqe_n, FSCHAN_DATASIZE);
+		ch->ch_cq[i] = r;
+		ch->ch_cq_prod++;
+		n++;
+	}
+	return n;
+}
+
+// Set ch_polling on every channel to 'polling'.  Clearing it is a
+// full barrier, so a client that posts after it sees the flag clear
+// and rings the doorbell, and one that posted before is seen by the
+// scan that follows.
+static void
+chan_set_polling(uint32_t polling)
+{
+	struct Chan *c;
+
+	for (c = chantab; c < chantab + nchan; c++)
+		xchg(&c->c_ch->ch_polling, polling);
+}
+
+// Drain the channels before we reply to the last request (which may
+// be a doorbell) and block again.  While we drain, clients see
+// ch_polling set and post without a doorbell.  Channels of clients
+// that have exited are released here.
+static void
+chan_poll(void)
+{
+	struct Chan *c, tmp;
+	int work;
+
+	do {
+		chan_set_polling(1);
+		do {
+			work = 0;
+			for (c = chantab; c < chantab + nchan; c++)
+				work += chan_drain(c);
+		} while (work);
+		chan_set_polling(0);
+
+		// Catch requests posted while the flag was going down
+		for (c = chantab; c < chantab + nchan; c++)
+			work += chan_drain(c);
+	} while (work);
+
+	// Keep the channels in use at the front of chantab, moving the
+	// freed page to the end.
+	for (c = chantab; c < chantab + nchan; ) {
+		if (envs[ENVX(c->c_envid)].env_id == c->c_envid &&
+		    envs[ENVX(c->c_envid)].env_status != ENV_FREE) {
+			c++;
+			continue;
+		}
+		sys_page_unmap(0, c->c_ch);
+		tmp = *c;
+		*c = chantab[--nchan];
+		chantab[nchan] = tmp;
+	}
+}
+
 fshandler handlers[] = {
 	// Open is handled specially because it passes pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
@@ -319,7 +475,9 @@ fshandler handlers[] = {
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_CHANNEL] =	serve_channel,
+	[FSREQ_DOORBELL] =	serve_doorbell
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
@@ -329,18 +487,40 @@ serve(void)
 	uint32_t req, whom;
 	int perm, r;
 	void *pg;
-
+	union Fsipc *args;
+	uint32_t msg[IPC_MSG_WORDS];
+
+	// Each reply goes out in the same system call that waits for
+	// the next request.
+	whom = 0;
+	r = 0;
+	pg = NULL;
+	perm = 0;
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		chan_poll();
+		req = ipc_reply_recv(whom, r, pg, perm,
+				     (int32_t *) &whom, fsreq, &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		// Small requests come as IPC message words and doorbells
+		// carry nothing; all others must contain an argument page
+		if (perm & PTE_P) {
+			args = fsreq;
+		} else if ((req == FSREQ_FLUSH || req == FSREQ_SET_SIZE) &&
+			   thisenv->env_ipc_msglen > 0) {
+			memset(msg, 0, sizeof(msg));
+			memmove(msg, (void *) thisenv->env_ipc_msg,
+				thisenv->env_ipc_msglen * sizeof(uint32_t));
+			args = (union Fsipc *) msg;
+		} else if (req == FSREQ_DOORBELL) {
+			args = NULL;
+		} else {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
+			whom = 0;
+			pg = NULL;
 			continue; // just leave it hanging...
 		}
 
@@ -348,13 +528,13 @@ serve(void)
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
 		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
+			r = handlers[req](whom, args);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		if (args == fsreq)
+			sys_page_unmap(0, fsreq);
 	}
 }
 
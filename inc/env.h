@@ -38,6 +38,51 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Scheduling priorities (nice values) for sys_env_set_priority.
+// Lower values get a larger share of the CPU; each step is worth
+// roughly 10% of CPU time against an env one step away.
+#define ENV_PRIO_MIN		-20
+#define ENV_PRIO_MAX		19
+#define ENV_PRIO_DEFAULT	0
+#define ENV_PRIO_SERVER		-10	// Default for the FS and network servers
+
+// Short IPC messages.  Instead of a page, a sender may pass up to
+// IPC_MSG_WORDS words: 'srcva' points to the words and 'perm' is
+// IPC_PERM_MSG(number of words).  The kernel copies them into the
+// receiver's env_ipc_msg, so no page table is touched.
+#define IPC_MSG_WORDS		4
+#define IPC_PERM_MSG(n)		((n) << 12)
+#define IPC_MSG_LEN(perm)	((unsigned) (perm) >> 12)
+
+// Sources for sys_ipc_select, in priority order: an envid, 0 for any
+// env, or IPC_SRC_RING for this env's message ring.
+#define IPC_SELECT_MAX		8
+#define IPC_SRC_RING		((envid_t) -1)
+
+// Asynchronous IPC message ring (see sys_ipc_ring).  The receiver
+// shares one page holding a struct IpcRing with the kernel.  Messages
+// sent with sys_ipc_try_send while the receiver is not waiting are
+// appended at ir_head by the kernel; the receiver consumes them from
+// ir_tail and advances ir_tail when done with each entry.  A page sent
+// with an entry is mapped at the ring's page area + slot * PGSIZE and
+// stays there until the slot is reused.
+#define IPC_RING_SIZE		32	// Entries per ring (power of 2)
+
+struct IpcRingEntry {
+	envid_t ire_from;		// envid of the sender
+	uint32_t ire_value;		// Data value sent
+	int ire_perm;			// Perm of the page sent, 0 if none
+	void *ire_va;			// VA at which that page is mapped
+	int ire_msglen;			// Number of message words sent
+	uint32_t ire_msg[IPC_MSG_WORDS]; // The message words
+};
+
+struct IpcRing {
+	volatile uint32_t ir_head;	// Next entry the kernel fills
+	volatile uint32_t ir_tail;	// Next entry the receiver takes
+	struct IpcRingEntry ir_ent[IPC_RING_SIZE];
+};
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -55,6 +100,14 @@ struct Env {
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
+	// Scheduling
+	struct Env *env_rq_next;	// Next env on a CPU run queue
+	struct Env *env_rq_prev;	// Previous env on a CPU run queue
+	int env_rq_cpu;			// CPU whose run queue holds us, or -1
+	int env_priority;		// Nice value, ENV_PRIO_MIN..ENV_PRIO_MAX
+	uint64_t env_vruntime;		// Weighted TSC cycles run so far
+	uint64_t env_runstart;		// TSC when we were last switched in
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
@@ -67,6 +120,31 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	envid_t env_ipc_recvfrom;	// Only accept messages from this env (0: any)
+	envid_t env_ipc_recvset[IPC_SELECT_MAX]; // Sources of sys_ipc_select
+	int env_ipc_recvsetlen;		// Number of them (0: not selecting)
+	uint32_t env_ipc_msg[IPC_MSG_WORDS]; // Message words sent to us
+	int env_ipc_msglen;		// Number of them (0: none)
+	struct IpcRing *env_ipc_ring;	// Kernel VA of our message ring, or NULL
+	void *env_ipc_ringva;		// Where pages sent via the ring are mapped
+
+	// Blocking IPC send
+	struct Env *env_ipc_senders;	// FIFO of envs blocked sending to us
+	struct Env *env_ipc_senders_tail; // Last env in that FIFO
+	struct Env *env_ipc_sendnext;	// Next env in the same FIFO
+	struct Env *env_ipc_sendto;	// Env we are blocked sending to, or NULL
+	uint32_t env_ipc_sendval;	// Value we are blocked sending
+	void *env_ipc_sendva;		// Page to send with it (>= UTOP: none)
+	int env_ipc_sendperm;		// Perm of that page
+	uint32_t env_ipc_sendmsg[IPC_MSG_WORDS]; // Message words we are sending
+	int env_ipc_sendmsglen;		// Number of them
+	bool env_ipc_calling;		// Wait for a message once ours is taken
+
+	// Blocking IPC receive from one env (e.g. the reply to a call)
+	struct Env *env_ipc_waiters;	// Envs blocked receiving only from us
+	struct Env *env_ipc_waitnext;	// Next env in the same list
+	struct Env *env_ipc_waitfor;	// Env we are blocked receiving from,
+					// or NULL
 };
 
 #endif // !JOS_INC_ENV_H
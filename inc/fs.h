@@ -70,7 +70,11 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Channel passes a struct Fschan page to share with the server
+	FSREQ_CHANNEL,
+	// Doorbell tells the server to look at our channel; no page
+	FSREQ_DOORBELL
 };
 
 union Fsipc {
@@ -113,4 +117,32 @@ union Fsipc {
 	char _pad[PGSIZE];
 };
 
+// Request channel shared once between a client env and the file
+// server (FSREQ_CHANNEL).  The client fills ch_sq[i] and ch_data[i]
+// for slots i = ch_sq_prod % FSCHAN_NSLOT onward and advances
+// ch_sq_prod; the server handles requests in order, leaving each
+// result in ch_cq[i] (read data in ch_data[i]) and advancing
+// ch_cq_prod.  While the server is scanning the channels it sets
+// ch_polling, and the client just waits; otherwise the client rings
+// FSREQ_DOORBELL with ipc_call, and the server drains every channel
+// before it replies, so the client sleeps in the kernel until its
+// requests are done.
+#define FSCHAN_NSLOT	8
+#define FSCHAN_DATASIZE	480
+
+struct Fschan {
+	volatile uint32_t ch_sq_prod;	// Requests posted by the client
+	volatile uint32_t ch_cq_prod;	// Requests completed by the server
+	volatile uint32_t ch_polling;	// Server will see new requests
+	struct Fschan_sqe {
+		int sqe_type;		// FSREQ_READ or FSREQ_WRITE
+		int sqe_fileid;
+		size_t sqe_n;		// At most FSCHAN_DATASIZE
+		int sqe_linked;		// Skip (result 0) if the previous
+					// request failed or fell short
+	} ch_sq[FSCHAN_NSLOT];
+	volatile int ch_cq[FSCHAN_NSLOT]; // Results, as for FSREQ_READ/WRITE
+	char ch_data[FSCHAN_NSLOT][FSCHAN_DATASIZE];
+};
+
 #endif /* !JOS_INC_FS_H */
@@ -50,16 +50,27 @@ envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
+envid_t	sys_fork(void);
 int	sys_env_set_status(envid_t env, int status);
+int	sys_env_set_priority(envid_t env, int priority);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_batch(struct PageOp *ops, int n);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg);
+int	sys_ipc_ring(struct IpcRing *ring, void *pgva);
+int	sys_ipc_select(const envid_t *srcs, int n, void *dstva);
 unsigned int sys_time_msec(void);
+uint64_t sys_time_nsec(void);
 /* network implementations */
 int     sys_net_try_send(char* data, int len);
 int     sys_net_try_recv(char* data, int* len);
@@ -80,11 +91,20 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
+int32_t ipc_select(const envid_t *srcs, int n, void *pg, envid_t *from_env_store,
+		   int *perm_store, uint32_t *ready_store);
+int	ipc_ring_init(struct IpcRing *ring, void *pgva);
+struct IpcRingEntry *ipc_ring_peek(struct IpcRing *ring);
+void	ipc_ring_pop(struct IpcRing *ring);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
+envid_t	ufork(void);
 envid_t	sfork(void);	// Challenge!
 
 // fd.c
@@ -145,6 +165,7 @@ void	wait(envid_t env);
 
 // sleep.c
 void    sleep(int interval);
+void    nsleep(uint64_t nsec);
 
 /* File open modes */
 #define	O_RDONLY	0x0000		/* open for reading only */
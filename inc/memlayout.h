@@ -17,6 +17,8 @@
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
 #define GD_TSS0   0x28     // Task segment selector for CPU 0
+#define GD_CPU0   0x30     // Per-CPU data segment for CPU 0
+// CPU i's selectors are GD_TSS0 + (i << 4) and GD_CPU0 + (i << 4).
 
 /*
  * Virtual memory map:                                Permissions
@@ -185,6 +187,13 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy allocator state, valid in the first page of a free block:
+	// pp_free is set, the block is 2^pp_order pages, and pp_prev is
+	// the previous block on that order's free list.
+	uint8_t pp_order;
+	uint8_t pp_free;
+	struct PageInfo *pp_prev;
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/env.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -20,7 +22,36 @@ enum {
 	SYS_time_msec,
         SYS_net_try_send,
         SYS_net_try_recv,
+	SYS_env_set_priority,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
+	SYS_ipc_ring,
+	SYS_ipc_select,
+	SYS_fork,
+	SYS_page_batch,
+	SYS_time_nsec,
 	NSYSCALLS
 };
 
+// One entry for sys_page_batch: a sys_page_alloc, sys_page_map or
+// sys_page_unmap call, with its result stored in po_result.
+enum {
+	PAGE_OP_ALLOC = 0,		// po_dstenv, po_dstva, po_perm
+	PAGE_OP_MAP,			// all fields
+	PAGE_OP_UNMAP,			// po_dstenv, po_dstva
+};
+
+#define PAGE_BATCH_MAX	32		// Most entries in one batch
+
+struct PageOp {
+	int po_op;
+	envid_t po_srcenv;
+	void *po_srcva;
+	envid_t po_dstenv;
+	void *po_dstva;
+	int po_perm;
+	int po_result;			// 0 or -E_*, filled in by the kernel
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
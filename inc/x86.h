@@ -293,4 +293,15 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically add 'incr' to *addr and return the old value.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t incr)
+{
+	asm volatile("lock; xaddl %0, %1" :
+			"+r" (incr), "+m" (*addr) :
+			:
+			"memory", "cc");
+	return incr;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -8,9 +8,14 @@
 
 #include <kern/console.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
-static void cons_putc(int c);
+
+// Serializes console output, so that messages printed by different
+// CPUs do not interleave.  Input is still covered by the big kernel
+// lock.
+static struct spinlock cons_lock;
 
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
@@ -431,8 +436,9 @@ cons_getc(void)
 	return 0;
 }
 
-// output a character to the console
-static void
+// output a character to the console; the caller holds the console
+// lock (see lock_console)
+void
 cons_putc(int c)
 {
 	serial_putc(c);
@@ -444,6 +450,7 @@ cons_putc(int c)
 void
 cons_init(void)
 {
+	spin_initlock(&cons_lock);
 	cga_init();
 	kbd_init();
 	serial_init();
@@ -453,12 +460,35 @@ cons_init(void)
 }
 
 
+// Take the console output lock.  A panicking kernel prints without
+// it, since the CPU that panicked may be holding it.
+void
+lock_console(void)
+{
+	extern const char *panicstr;
+
+	if (!panicstr)
+		spin_lock(&cons_lock);
+}
+
+void
+unlock_console(void)
+{
+	extern const char *panicstr;
+
+	if (!panicstr)
+		spin_unlock(&cons_lock);
+}
+
+
 // `High'-level console I/O.  Used by readline and cprintf.
 
 void
 cputchar(int c)
 {
+	lock_console();
 	cons_putc(c);
+	unlock_console();
 }
 
 int
@@ -19,6 +19,10 @@
 
 void cons_init(void);
 int cons_getc(void);
+void cons_putc(int c);
+
+void lock_console(void);
+void unlock_console(void);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
@@ -6,6 +6,7 @@
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
 #include <inc/env.h>
+#include <kern/spinlock.h>
 
 // Maximum number of CPUs
 #define NCPU  8
@@ -17,12 +18,62 @@ enum {
 	CPU_HALTED,
 };
 
+// Per-CPU queue of ENV_RUNNABLE environments, linked through
+// env_rq_next/env_rq_prev and kept sorted by env_vruntime, so the
+// env that is furthest behind its fair share is at the head.
+struct RunQueue {
+	struct spinlock rq_lock;        // Protects the queue and its links
+	struct Env *rq_head;
+	struct Env *rq_tail;
+	uint32_t rq_len;                // Number of envs on the queue
+	uint64_t rq_min_vruntime;       // Monotonic floor for env_vruntime
+};
+
+// Per-CPU cache of free pages in front of the buddy allocator.
+// page_alloc and page_free use it alone while it is neither empty nor
+// full, and otherwise move PAGE_MAG_BATCH pages at a time.  Only the
+// owning CPU takes pm_lock, except to reclaim pages when memory is
+// short, so the lock stays in that CPU's cache.
+#define PAGE_MAG_SIZE	32
+#define PAGE_MAG_BATCH	16
+
+struct PageMag {
+	struct spinlock pm_lock;
+	struct PageInfo *pm_pages[PAGE_MAG_SIZE]; // Free pages, hottest last
+	int pm_count;
+	uint32_t pm_hits;               // Allocs and frees it served alone
+	uint32_t pm_refills;            // Allocs that refilled it first
+	uint32_t pm_drains;             // Frees that drained it first
+};
+
+// TLB entries to invalidate in one address space on other CPUs.  Past
+// TLB_BATCH pages the receiver flushes its whole (non-global) TLB.
+#define TLB_BATCH	16
+
+struct TlbBatch {
+	pde_t *tb_pgdir;
+	int tb_n;                       // > TLB_BATCH: flush everything
+	uintptr_t tb_va[TLB_BATCH];
+};
+
 // Per-CPU state
 struct CpuInfo {
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
+	struct CpuInfo *cpu_self;       // Points here, for thiscpu
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	struct RunQueue cpu_rq;         // Envs waiting to run on this CPU
+	bool cpu_resched;               // A queued env should preempt curenv
+	uint32_t cpu_steals;            // Envs taken from other CPUs' queues
+	uint32_t cpu_migrations;        // Runs of envs that last ran elsewhere
+	struct PageMag cpu_pagemag;     // Free pages cached on this CPU
+	pde_t *cpu_pgdir;               // Page directory loaded in %cr3
+	volatile unsigned cpu_in_user;  // Running user code (interrupts on)
+	struct TlbBatch cpu_tlb_out;    // Invalidations not yet sent
+	struct spinlock cpu_tlb_lock;   // Protects cpu_tlb_in and _pending
+	struct TlbBatch cpu_tlb_in;     // Invalidations sent to this CPU
+	volatile unsigned cpu_tlb_pending; // cpu_tlb_in is not yet applied
 };
 
 // Initialized in mpconfig.c
@@ -35,12 +86,46 @@ extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
 int cpunum(void);
-#define thiscpu (&cpus[cpunum()])
+
+// This CPU's struct CpuInfo, found through the per-CPU segment that
+// env_init_percpu loads into %gs.  Unlike cpunum(), no LAPIC read.
+static inline struct CpuInfo *
+cpu_self(void)
+{
+	struct CpuInfo *c;
+
+	asm volatile("movl %%gs:%c1,%0" : "=r" (c)
+	    : "i" (offsetof(struct CpuInfo, cpu_self)));
+	return c;
+}
+#define thiscpu (cpu_self())
+
+// The environment running on this CPU (curenv), in one %gs-relative
+// load rather than cpu_self() followed by a load of cpu_env.  Only
+// this CPU changes its cpu_env, and only through cpu_set_curenv, so
+// the volatile asm keeps reads and writes in program order.
+static inline struct Env *
+cpu_curenv(void)
+{
+	struct Env *e;
+
+	asm volatile("movl %%gs:%c1,%0" : "=r" (e)
+	    : "i" (offsetof(struct CpuInfo, cpu_env)));
+	return e;
+}
+
+static inline void
+cpu_set_curenv(struct Env *e)
+{
+	asm volatile("movl %0,%%gs:%c1" : : "r" (e),
+	    "i" (offsetof(struct CpuInfo, cpu_env)));
+}
 
 void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
 
 #endif
@@ -14,6 +14,7 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/syscall.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
@@ -36,7 +37,7 @@ static struct Env *env_free_list;	// Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] =
+struct Segdesc gdt[2 * NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -54,7 +55,8 @@ struct Segdesc gdt[NCPU + 5] =
 	[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
 
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
-	// in trap_init_percpu()
+	// in trap_init_percpu(), and per-CPU data segments (starting from
+	// GD_CPU0) in env_init_percpu()
 	[GD_TSS0 >> 3] = SEG_NULL
 };
 
@@ -123,11 +125,13 @@ env_init(void)
         env_free_list = &envs[0];
         envs[0].env_status = ENV_FREE;
         envs[0].env_id = 0;
+        envs[0].env_rq_cpu = -1;
 
         for (env_index = 1; env_index < NENV; env_index++) {
             envs[env_index-1].env_link = &envs[env_index];
             envs[env_index].env_status = ENV_FREE;
             envs[env_index].env_id = 0;
+            envs[env_index].env_rq_cpu = -1;
         }
 
 	// Per-CPU part of the initialization
@@ -135,13 +139,23 @@ env_init(void)
 }
 
 // Load GDT and segment descriptors.
+// Must run on each CPU before anything uses thiscpu.
 void
 env_init_percpu(void)
 {
+	int id = cpunum();
+	struct CpuInfo *c = &cpus[id];
+
 	lgdt(&gdt_pd);
-	// The kernel never uses GS or FS, so we leave those set to
-	// the user data segment.
-	asm volatile("movw %%ax,%%gs" :: "a" (GD_UD|3));
+	// GS covers this CPU's struct CpuInfo, so that thiscpu is one
+	// load.  User environments run with GS reset to the user data
+	// segment (see env_pop_tf), and trap entry points it back here.
+	c->cpu_self = c;
+	gdt[(GD_CPU0 >> 3) + 2 * id] = SEG16(STA_W, (uint32_t) c,
+					     sizeof(struct CpuInfo) - 1, 0);
+	asm volatile("movw %%ax,%%gs" :: "a" (GD_CPU0 + (id << 4)));
+	// The kernel never uses FS, so we leave it set to the user
+	// data segment.
 	asm volatile("movw %%ax,%%fs" :: "a" (GD_UD|3));
 	// The kernel does use ES, DS, and SS.  We'll change between
 	// the kernel and user data segments as needed.
@@ -237,6 +251,7 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_type = ENV_TYPE_USER;
 	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_priority = ENV_PRIO_DEFAULT;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -267,13 +282,23 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
 
-	// Also clear the IPC receiving flag.
+	// Also clear the IPC receiving flag, blocked-send state and ring.
 	e->env_ipc_recving = 0;
+	e->env_ipc_recvsetlen = 0;
+	e->env_ipc_senders = e->env_ipc_senders_tail = NULL;
+	e->env_ipc_sendto = NULL;
+	e->env_ipc_calling = 0;
+	e->env_ipc_ring = NULL;
+	e->env_ipc_waiters = NULL;
+	e->env_ipc_waitfor = NULL;
 
 	// commit the allocation
 	env_free_list = e->env_link;
 	*newenv_store = e;
 
+	// Queue it to run on this CPU.
+	sched_wakeup(e);
+
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 	return 0;
 }
@@ -423,6 +448,9 @@ env_create(uint8_t *binary, enum EnvType type)
             panic("env_alloc(): env allocation failed\n");
         }
         newenv_store->env_type = type;
+        if (type == ENV_TYPE_FS || type == ENV_TYPE_NS) {
+           newenv_store->env_priority = ENV_PRIO_SERVER;
+        }
         load_icode(newenv_store, binary);
 
 	// If this is the file server (type == ENV_TYPE_FS) give it I/O privileges.
@@ -446,8 +474,10 @@ env_free(struct Env *e)
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
-	if (e == curenv)
+	if (e == curenv) {
 		lcr3(PADDR(kern_pgdir));
+		thiscpu->cpu_pgdir = kern_pgdir;
+	}
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -460,6 +490,12 @@ env_free(struct Env *e)
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a 4MB page has no page table
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			page_remove_large(e->env_pgdir, PGADDR(pdeno, 0, 0));
+			continue;
+		}
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
@@ -480,7 +516,11 @@ env_free(struct Env *e)
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
 
+	// Fail any IPC sends blocked on us and withdraw our own.
+	ipc_cancel(e);
+
 	// return the environment to the free list
+	sched_remove(e);
 	e->env_status = ENV_FREE;
 	e->env_link = env_free_list;
 	env_free_list = e;
@@ -505,7 +545,7 @@ env_destroy(struct Env *e)
 	env_free(e);
 
 	if (curenv == e) {
-		curenv = NULL;
+		cpu_set_curenv(NULL);
 		sched_yield();
 	}
 }
@@ -520,16 +560,22 @@ env_destroy(struct Env *e)
 void
 env_pop_tf(struct Trapframe *tf)
 {
+	int id = thiscpu->cpu_id;
+	// User code gets the user data segment back in GS.
+	uint16_t gs = (tf->tf_cs & 3) ? GD_UD|3 : GD_CPU0 + (id << 4);
+
 	// Record the CPU we are running on for user-space debugging
-	curenv->env_cpunum = cpunum();
+	if (curenv)
+		curenv->env_cpunum = id;
 
-	__asm __volatile("movl %0,%%esp\n"
+	__asm __volatile("movw %w1,%%gs\n"
+		"\tmovl %0,%%esp\n"
 		"\tpopal\n"
 		"\tpopl %%es\n"
 		"\tpopl %%ds\n"
 		"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
 		"\tiret"
-		: : "g" (tf) : "memory");
+		: : "g" (tf), "r" (gs) : "memory");
 	panic("iret failed");  /* mostly to placate the compiler */
 }
 
@@ -561,14 +607,25 @@ env_run(struct Env *e)
 
 	// LAB 3: Your code here.
         if (curenv != e) {
-            if (curenv && curenv->env_status == ENV_RUNNING) {
-               curenv->env_status = ENV_RUNNABLE;
+            if (curenv) {
+               sched_charge(curenv);
+               if (curenv->env_status == ENV_RUNNING) {
+                  sched_preempt(curenv);
+               }
+            }
+            sched_remove(e);
+            if (e->env_runs > 0 && e->env_cpunum != thiscpu->cpu_id) {
+               thiscpu->cpu_migrations++;
             }
-            curenv = e;
+            cpu_set_curenv(e);
             curenv->env_status = ENV_RUNNING;
             curenv->env_runs++;
+            curenv->env_runstart = read_tsc();
             lcr3(PADDR(curenv->env_pgdir));
+            thiscpu->cpu_pgdir = curenv->env_pgdir;
         }
+        tlb_shootdown();
         unlock_kernel();
+        xchg(&thiscpu->cpu_in_user, 1);
         env_pop_tf(&curenv->env_tf);
 }
@@ -20,3 +20,35 @@ mc146818_write(unsigned reg, unsigned datum)
 	outb(IO_RTC, reg);
 	outb(IO_RTC+1, datum);
 }
+
+// Measure how fast the TSC runs, in Hz, by timing 50 ms of PIT
+// channel 2 (the speaker timer, which nothing else uses).
+// Returns 0 if the PIT never finished counting.
+uint64_t
+pit_tsc_hz(void)
+{
+	uint32_t count = TIMER_FREQ / 20, spins = 0;
+	uint64_t start, end;
+	uint8_t ppi;
+
+	// Gate channel 2 on, with the speaker off.
+	ppi = inb(IO_PPI);
+	outb(IO_PPI, (ppi & ~0x02) | 0x01);
+
+	// Channel 2, low then high byte, mode 0: the output goes high
+	// when the count reaches zero.
+	outb(TIMER_MODE, 0xb0);
+	outb(TIMER_CNTR2, count & 0xff);
+	outb(TIMER_CNTR2, count >> 8);
+
+	start = read_tsc();
+	while (!(inb(IO_PPI) & 0x20))
+		if (++spins == 0x10000000)
+			break;
+	end = read_tsc();
+
+	outb(IO_PPI, ppi);
+	if (spins == 0x10000000)
+		return 0;
+	return (end - start) * 20;
+}
@@ -6,8 +6,16 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 #define	IO_RTC		0x070		/* RTC port */
 
+#define	IO_TIMER1	0x040		/* 8253/8254 PIT */
+#define	TIMER_CNTR2	(IO_TIMER1 + 2)	/* channel 2 counter */
+#define	TIMER_MODE	(IO_TIMER1 + 3)	/* mode/command register */
+#define	TIMER_FREQ	1193182		/* PIT input clock, Hz */
+#define	IO_PPI		0x061		/* port B: channel 2 gate and output */
+
 #define	MC_NVRAM_START	0xe	/* start of NVRAM: offset 14 */
 #define	MC_NVRAM_SIZE	50	/* 50 bytes of NVRAM */
 
@@ -28,5 +36,6 @@
 
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
+uint64_t pit_tsc_hz(void);
 
 #endif	// !JOS_KERN_KCLOCK_H
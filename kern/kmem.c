@@ -0,0 +1,261 @@
+// Slab allocator for small fixed-size kernel objects.  See kern/kmem.h.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/kmem.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+
+// A slab is one page: this header, then the slab's color offset, then
+// kc_perslab objects.  Free objects are linked through their first word.
+struct Slab {
+	struct kmem_cache *sl_cache;
+	struct Slab *sl_next;
+	struct Slab **sl_pprev;         // Pointer to us in the list we are on
+	void *sl_free;                  // Free objects
+	int sl_inuse;                   // Objects not on sl_free
+};
+
+struct kmem_cache kmem_caches[KMEM_NCACHES];
+
+static void check_kmem(void);
+
+void
+kmem_init(void)
+{
+	check_kmem();
+}
+
+static void
+slab_push(struct Slab **list, struct Slab *sl)
+{
+	sl->sl_next = *list;
+	if (sl->sl_next)
+		sl->sl_next->sl_pprev = &sl->sl_next;
+	sl->sl_pprev = list;
+	*list = sl;
+}
+
+static void
+slab_unlink(struct Slab *sl)
+{
+	*sl->sl_pprev = sl->sl_next;
+	if (sl->sl_next)
+		sl->sl_next->sl_pprev = sl->sl_pprev;
+}
+
+// Distance between two colors of a cache.
+static size_t
+color_step(struct kmem_cache *kc)
+{
+	return MAX(kc->kc_align, (size_t) KMEM_CACHE_LINE);
+}
+
+//
+// Create a cache of objects of 'size' bytes, aligned to 'align' (a
+// power of two; word alignment at least).  Returns NULL if the object
+// is larger than KMEM_MAX_SIZE or there are already KMEM_NCACHES caches.
+//
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align)
+{
+	struct kmem_cache *kc;
+	size_t left;
+
+	align = MAX(align, sizeof(void *));
+	if ((align & (align - 1)) || size == 0
+	    || ROUNDUP(size, align) > KMEM_MAX_SIZE)
+		return NULL;
+	for (kc = kmem_caches; kc < kmem_caches + KMEM_NCACHES; kc++)
+		if (!kc->kc_size)
+			break;
+	if (kc == kmem_caches + KMEM_NCACHES)
+		return NULL;
+
+	memset(kc, 0, sizeof(*kc));
+	strncpy(kc->kc_name, name, sizeof(kc->kc_name) - 1);
+	kc->kc_size = ROUNDUP(size, align);
+	kc->kc_align = align;
+	kc->kc_offset = ROUNDUP(sizeof(struct Slab), align);
+	kc->kc_perslab = (PGSIZE - kc->kc_offset) / kc->kc_size;
+	left = PGSIZE - kc->kc_offset - kc->kc_perslab * kc->kc_size;
+	kc->kc_ncolors = left / color_step(kc) + 1;
+	return kc;
+}
+
+// Carve a new page into a slab of free objects.
+static struct Slab *
+slab_create(struct kmem_cache *kc)
+{
+	struct PageInfo *pp;
+	struct Slab *sl;
+	char *objs;
+	int i;
+
+	if (!(pp = page_alloc(0)))
+		return NULL;
+	sl = page2kva(pp);
+	sl->sl_cache = kc;
+	sl->sl_free = NULL;
+	sl->sl_inuse = 0;
+
+	// Slabs start their objects at different cache line offsets, so
+	// that the same object in each slab does not map to one cache set.
+	objs = (char *) sl + kc->kc_offset + kc->kc_nextcolor * color_step(kc);
+	kc->kc_nextcolor = (kc->kc_nextcolor + 1) % kc->kc_ncolors;
+	for (i = kc->kc_perslab - 1; i >= 0; i--) {
+		*(void **) (objs + i * kc->kc_size) = sl->sl_free;
+		sl->sl_free = objs + i * kc->kc_size;
+	}
+	kc->kc_nslabs++;
+	return sl;
+}
+
+// Take a free object from the cache's slabs.
+static void *
+slab_alloc(struct kmem_cache *kc)
+{
+	struct Slab *sl;
+	void *obj;
+
+	if (!(sl = kc->kc_partial)) {
+		if ((sl = kc->kc_empty))
+			slab_unlink(sl);
+		else if (!(sl = slab_create(kc)))
+			return NULL;
+		slab_push(&kc->kc_partial, sl);
+	}
+	obj = sl->sl_free;
+	sl->sl_free = *(void **) obj;
+	if (++sl->sl_inuse == kc->kc_perslab) {
+		slab_unlink(sl);
+		slab_push(&kc->kc_full, sl);
+	}
+	return obj;
+}
+
+// Give an object back to its slab.  Of the slabs left empty, one is
+// kept for the next allocation and the rest go back to page_free.
+static void
+slab_free(struct kmem_cache *kc, void *obj)
+{
+	struct Slab *sl = ROUNDDOWN(obj, PGSIZE);
+
+	assert(sl->sl_cache == kc);
+	*(void **) obj = sl->sl_free;
+	sl->sl_free = obj;
+	if (sl->sl_inuse-- == kc->kc_perslab) {
+		slab_unlink(sl);
+		slab_push(&kc->kc_partial, sl);
+	}
+	if (sl->sl_inuse)
+		return;
+	slab_unlink(sl);
+	if (kc->kc_empty) {
+		page_free(pa2page(PADDR(sl)));
+		kc->kc_nslabs--;
+	} else
+		slab_push(&kc->kc_empty, sl);
+}
+
+//
+// Allocate an object from 'kc', cleared if (alloc_flags & ALLOC_ZERO).
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct kmem_cache *kc, int alloc_flags)
+{
+	struct KmemCpu *cc = &kc->kc_cpu[thiscpu->cpu_id];
+	void *obj;
+
+	// This CPU's stack is refilled halfway when it runs dry.
+	if (!cc->kcc_count)
+		while (cc->kcc_count < KMEM_CPU_CACHE / 2
+		       && (obj = slab_alloc(kc)))
+			cc->kcc_objs[cc->kcc_count++] = obj;
+	if (!cc->kcc_count)
+		return NULL;
+
+	obj = cc->kcc_objs[--cc->kcc_count];
+	kc->kc_inuse++;
+	if (alloc_flags & ALLOC_ZERO)
+		memset(obj, 0, kc->kc_size);
+	return obj;
+}
+
+//
+// Return an object allocated from 'kc'.
+//
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct KmemCpu *cc = &kc->kc_cpu[thiscpu->cpu_id];
+	int i;
+
+	// A full stack gives its coldest half back to the slabs.
+	if (cc->kcc_count == KMEM_CPU_CACHE) {
+		for (i = 0; i < KMEM_CPU_CACHE / 2; i++)
+			slab_free(kc, cc->kcc_objs[i]);
+		memmove(cc->kcc_objs, cc->kcc_objs + KMEM_CPU_CACHE / 2,
+			(KMEM_CPU_CACHE / 2) * sizeof(cc->kcc_objs[0]));
+		cc->kcc_count -= KMEM_CPU_CACHE / 2;
+	}
+	cc->kcc_objs[cc->kcc_count++] = obj;
+	kc->kc_inuse--;
+}
+
+//
+// Free a cache with no objects in use, and its pages.
+//
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct KmemCpu *cc;
+
+	assert(kc->kc_inuse == 0);
+	for (cc = kc->kc_cpu; cc < kc->kc_cpu + NCPU; cc++)
+		while (cc->kcc_count)
+			slab_free(kc, cc->kcc_objs[--cc->kcc_count]);
+	assert(!kc->kc_partial && !kc->kc_full);
+	if (kc->kc_empty)
+		page_free(pa2page(PADDR(kc->kc_empty)));
+	kc->kc_size = 0;
+}
+
+static void
+check_kmem(void)
+{
+	struct kmem_cache *kc;
+	unsigned char *objs[200];
+	int i, j;
+
+	assert((kc = kmem_cache_create("check", 20, 8)));
+	assert(kc->kc_size == 24 && kc->kc_perslab > 100);
+	for (i = 0; i < 200; i++) {
+		assert((objs[i] = kmem_cache_alloc(kc, ALLOC_ZERO)));
+		assert((uintptr_t) objs[i] % 8 == 0);
+		for (j = 0; j < 20; j++)
+			assert(objs[i][j] == 0);
+		memset(objs[i], i, 20);
+	}
+	for (i = 0; i < 200; i++)
+		for (j = 0; j < 20; j++)
+			assert(objs[i][j] == i);
+	assert(kc->kc_inuse == 200 && kc->kc_nslabs >= 2);
+
+	// the second slab is colored differently from the first
+	if (kc->kc_ncolors > 1)
+		assert(PGOFF(objs[0]) != PGOFF(objs[199]));
+
+	for (i = 0; i < 200; i++)
+		kmem_cache_free(kc, objs[i]);
+	assert(kc->kc_inuse == 0);
+	kmem_cache_destroy(kc);
+
+	assert(!kmem_cache_create("big", KMEM_MAX_SIZE + 1, 4));
+	assert(!kmem_cache_create("odd", 16, 12));
+
+	cprintf("check_kmem() succeeded!\n");
+}
@@ -0,0 +1,54 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+
+// Object caches ("slab allocator") for small fixed-size kernel objects.
+// Each cache carves single pages from page_alloc into slabs of
+// equal-sized objects, and keeps a few free objects per CPU in front
+// of the slabs.
+
+#define KMEM_NCACHES	32		// Most caches that can exist
+#define KMEM_MAX_SIZE	(PGSIZE / 8)	// Largest object size
+#define KMEM_CPU_CACHE	16		// Free objects kept per CPU
+#define KMEM_CACHE_LINE	64		// Step between slab colors
+
+// Per-CPU stack of free objects, hottest last.
+struct KmemCpu {
+	void *kcc_objs[KMEM_CPU_CACHE];
+	int kcc_count;
+};
+
+struct kmem_cache {
+	char kc_name[16];
+	size_t kc_size;                 // Object size, rounded up to kc_align
+	                                // (0 if this cache is unused)
+	size_t kc_align;
+	size_t kc_offset;               // First object in a slab, before coloring
+	int kc_perslab;                 // Objects per slab
+	int kc_ncolors;                 // Distinct slab offsets used
+	int kc_nextcolor;               // Offset of the next slab created
+	struct Slab *kc_partial;        // Slabs with used and free objects
+	struct Slab *kc_full;           // Slabs with no free objects
+	struct Slab *kc_empty;          // At most one slab with no objects used
+	size_t kc_nslabs;
+	size_t kc_inuse;                // Objects handed out to callers
+	struct KmemCpu kc_cpu[NCPU];
+};
+
+void	kmem_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align);
+void	kmem_cache_destroy(struct kmem_cache *kc);
+void	*kmem_cache_alloc(struct kmem_cache *kc, int alloc_flags);
+void	kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+// All caches; unused entries have kc_size 0.
+extern struct kmem_cache kmem_caches[KMEM_NCACHES];
+
+#endif /* !JOS_KERN_KMEM_H */
@@ -173,6 +173,16 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	}
 }
 
+// Send 'vector' to the CPU whose local APIC ID is 'apicid'.
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
 void
 lapic_ipi(int vector)
 {
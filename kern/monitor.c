@@ -11,6 +11,9 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+#include <kern/kmem.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -25,7 +28,13 @@ struct Command {
 static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
-        { "backtrace", "Back trace the functions", mon_backtrace}
+        { "backtrace", "Back trace the functions", mon_backtrace},
+	{ "sched", "Display per-CPU run queue and load balancing counts", mon_sched },
+	{ "buddyinfo", "Display free page blocks and fragmentation", mon_buddyinfo },
+	{ "slabinfo", "Display kernel object caches and their use", mon_slabinfo },
+	{ "pagemag", "Display per-CPU page cache and zeroed pool use", mon_pagemag },
+	{ "spinlocks", "Display spinlock acquisitions and contention", mon_spinlocks },
+	{ "lockstat", "Display lock hold and wait time by call site [reset]", mon_lockstat },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -87,7 +96,175 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_sched(int argc, char **argv, struct Trapframe *tf)
+{
+	int i;
+	uint32_t steals = 0, migrations = 0;
+
+	cprintf("CPU  queued    steals  migrations\n");
+	for (i = 0; i < ncpu; i++) {
+		cprintf("%3d  %6u  %8u  %10u\n", i, cpus[i].cpu_rq.rq_len,
+			cpus[i].cpu_steals, cpus[i].cpu_migrations);
+		steals += cpus[i].cpu_steals;
+		migrations += cpus[i].cpu_migrations;
+	}
+	cprintf("all          %8u  %10u\n", steals, migrations);
+	return 0;
+}
+
+// For each order, the free blocks of that size, and how much of the
+// free memory is in smaller blocks and so useless for a request of
+// that order.
+int
+mon_buddyinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	size_t nfree = 0, below = 0, n;
+	int o;
+
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		nfree += page_nfree_blocks(o) << o;
+
+	cprintf("order  blocks   pages  unusable\n");
+	for (o = 0; o <= PAGE_MAX_ORDER; o++) {
+		n = page_nfree_blocks(o);
+		cprintf("%5d  %6u  %6u  %7u%%\n", o, n, n << o,
+			nfree ? below * 100 / nfree : 0);
+		below += n << o;
+	}
+	cprintf("free pages %u of %u\n", nfree, npages);
+	return 0;
+}
+
+int
+mon_pagemag(int argc, char **argv, struct Trapframe *tf)
+{
+	int i;
+	struct PageMag *pm;
+
+	cprintf("CPU  cached      hits   refills    drains\n");
+	for (i = 0; i < ncpu; i++) {
+		pm = &cpus[i].cpu_pagemag;
+		cprintf("%3d  %6d  %8u  %8u  %8u\n", i, pm->pm_count,
+			pm->pm_hits, pm->pm_refills, pm->pm_drains);
+	}
+	cprintf("zeroed pool %d of %d, hits %u, misses %u\n", zero_pool_count,
+		ZERO_POOL_SIZE, zero_pool_hits, zero_pool_misses);
+	return 0;
+}
+
+int
+mon_slabinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	struct kmem_cache *kc;
+	size_t total, cached;
+	int i;
+
+	cprintf("name             size  active   total  slabs  cached  use\n");
+	for (kc = kmem_caches; kc < kmem_caches + KMEM_NCACHES; kc++) {
+		if (!kc->kc_size)
+			continue;
+		total = kc->kc_nslabs * kc->kc_perslab;
+		for (cached = 0, i = 0; i < ncpu; i++)
+			cached += kc->kc_cpu[i].kcc_count;
+		cprintf("%-15s  %4u  %6u  %6u  %5u  %6u  %2u%%\n", kc->kc_name,
+			kc->kc_size, kc->kc_inuse, total, kc->kc_nslabs, cached,
+			total ? kc->kc_inuse * 100 / total : 0);
+	}
+	return 0;
+}
+
+int
+mon_spinlocks(int argc, char **argv, struct Trapframe *tf)
+{
+#ifdef DEBUG_SPINLOCK
+	struct spinlock *lk;
+
+	cprintf("name            acquired  contended  spin Kcycles\n");
+	for (lk = spinlocks; lk; lk = lk->link)
+		cprintf("%-14s  %8u  %9u  %12u\n", lk->name, lk->nacquire,
+			lk->ncontended, (uint32_t) (lk->spin_cycles >> 10));
+#else
+	cprintf("spinlock statistics need DEBUG_SPINLOCK\n");
+#endif
+	return 0;
+}
+
+#define LOCKSTAT_TOP	20	// Call sites shown by "lockstat"
 
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+#ifdef LOCKSTAT
+	static struct LockSite sites[LOCKSTAT_NSITES];
+	struct LockSite *ls, tmp;
+	struct Eipdebuginfo info;
+	struct spinlock *lk;
+	int c, i, j, n = 0;
+
+	if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+		// Held locks (kernel_lock, at least) point at entries we are
+		// about to clear; untrack them, so that their release is not
+		// charged to whatever reuses the entry.
+		for (lk = spinlocks; lk; lk = lk->link)
+			lk->site = NULL;
+		memset(lockstat_sites, 0, ncpu * sizeof(lockstat_sites[0]));
+		lockstat_dropped = 0;
+		return 0;
+	}
+
+	// Add up the per-CPU tables, then sort by hold time.
+	for (c = 0; c < ncpu; c++)
+		for (ls = lockstat_sites[c]; ls < lockstat_sites[c] + LOCKSTAT_NSITES; ls++) {
+			if (!ls->ls_site)
+				continue;
+			for (i = 0; i < n; i++)
+				if (sites[i].ls_site == ls->ls_site
+				    && sites[i].ls_lock == ls->ls_lock)
+					break;
+			if (i == n) {
+				if (n == LOCKSTAT_NSITES)
+					continue;
+				memset(&sites[n++], 0, sizeof(sites[0]));
+				sites[i].ls_lock = ls->ls_lock;
+				sites[i].ls_site = ls->ls_site;
+			}
+			sites[i].ls_nacquire += ls->ls_nacquire;
+			sites[i].ls_wait_cycles += ls->ls_wait_cycles;
+			sites[i].ls_hold_cycles += ls->ls_hold_cycles;
+		}
+	for (i = 1; i < n; i++)
+		for (j = i; j > 0 && sites[j].ls_hold_cycles > sites[j-1].ls_hold_cycles; j--) {
+			tmp = sites[j];
+			sites[j] = sites[j-1];
+			sites[j-1] = tmp;
+		}
+
+	cprintf("lock            acquired  hold Kcyc  wait Kcyc  call site\n");
+	for (i = 0; i < n && i < LOCKSTAT_TOP; i++) {
+		ls = &sites[i];
+		cprintf("%-14s  %8u  %9u  %9u  ", ls->ls_lock->name,
+			ls->ls_nacquire, (uint32_t) (ls->ls_hold_cycles >> 10),
+			(uint32_t) (ls->ls_wait_cycles >> 10));
+		if (ls->ls_site >= LOCKSTAT_SYSCALL(0) && ls->ls_site < KERNBASE)
+			cprintf("syscall %d\n", ls->ls_site - LOCKSTAT_SYSCALL(0));
+		else if (ls->ls_site < KERNBASE)
+			cprintf("trap %d\n", ls->ls_site - LOCKSTAT_TRAP(0));
+		else if (debuginfo_eip(ls->ls_site, &info) >= 0)
+			cprintf("%s:%d: %.*s+%x\n", info.eip_file, info.eip_line,
+				info.eip_fn_namelen, info.eip_fn_name,
+				ls->ls_site - info.eip_fn_addr);
+		else
+			cprintf("%08x\n", ls->ls_site);
+	}
+	if (lockstat_dropped)
+		cprintf("%u acquisitions not tracked: call site tables full\n",
+			lockstat_dropped);
+#else
+	cprintf("lockstat needs LOCKSTAT in kern/spinlock.h\n");
+#endif
+	return 0;
+}
 
 /***** Kernel monitor command interpreter *****/
 
@@ -185,6 +185,12 @@ mp_init(void)
 				bootcpu = &cpus[ncpu];
 			if (ncpu < NCPU) {
 				cpus[ncpu].cpu_id = ncpu;
+				__spin_initlock(&cpus[ncpu].cpu_tlb_lock,
+						"cpu_tlb_lock");
+				__spin_initlock(&cpus[ncpu].cpu_rq.rq_lock,
+						"rq_lock");
+				__spin_initlock(&cpus[ncpu].cpu_pagemag.pm_lock,
+						"pm_lock");
 				ncpu++;
 			} else {
 				cprintf("SMP: too many CPUs, CPU %d disabled\n",
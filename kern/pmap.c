@@ -10,6 +10,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -18,7 +19,28 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+
+// Protects the buddy free lists and zero_pool below.  Each CPU's
+// magazine has its own pm_lock, taken before this one.
+static struct spinlock page_lock;
+
+// Buddy allocator: free_area[k] lists the free blocks of 2^k pages.
+static struct PageInfo *free_area[PAGE_MAX_ORDER + 1];
+static size_t free_blocks[PAGE_MAX_ORDER + 1];	// Length of each list
+static size_t nfree_pages;			// Free pages in all blocks
+
+// Whether the CPU supports 4MB pages (CR4_PSE), set in mem_init.
+bool page_pse;
+// PTE_G if the CPU supports global pages (CR4_PGE), else 0.  Every
+// address space maps the kernel identically, so its TLB entries can
+// survive a CR3 reload.
+static uint32_t page_global;
+
+// Zeroed pages for page_alloc(ALLOC_ZERO), filled by page_zero_idle.
+static struct PageInfo *zero_pool[ZERO_POOL_SIZE];
+int zero_pool_count;
+uint32_t zero_pool_hits;		// ALLOC_ZERO requests served from the pool
+uint32_t zero_pool_misses;		// ALLOC_ZERO requests cleared inline
 
 
 // --------------------------------------------------------------
@@ -79,7 +101,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the page free lists have been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -125,12 +147,26 @@ boot_alloc(uint32_t n)
 void
 mem_init(void)
 {
-	uint32_t cr0;
+	uint32_t cr0, edx;
 	size_t n;
 
+	spin_initlock(&page_lock);
+
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
 
+	// Map large regions with 4MB pages if the CPU has them (PSE),
+	// and mark kernel mappings global if it has PGE.  Build with
+	// DEFS=-DNO_PGE to leave them non-global, e.g. to compare
+	// pingpongbench with and without.
+	cpuid(1, NULL, NULL, NULL, &edx);
+	page_pse = (edx & (1 << 3)) != 0;
+#ifndef NO_PGE
+	page_global = (edx & (1 << 13)) ? PTE_G : 0;
+#endif
+	// (so that benchmark logs say which kernel they came from)
+	cprintf("Global kernel pages: %s\n", page_global ? "on" : "off");
+
 	// Remove this line when you're ready to test this function.
 	//panic("mem_init: This function is not finished\n");
 
@@ -146,6 +182,7 @@ mem_init(void)
 	// following line.)
 
 	// Permissions: kernel R, user R
+	// (Never global: every environment's UVPT shows its own tables.)
 	kern_pgdir[PDX(UVPT)] = PADDR(kern_pgdir) | PTE_U | PTE_P;
 
 	//////////////////////////////////////////////////////////////////////
@@ -188,8 +225,8 @@ mem_init(void)
 	//    - pages itself -- kernel RW, user NONE
 	// Your code goes here:
 
-        int perm_kern = PTE_P | PTE_W;
-        int perm_user = PTE_U | PTE_P;
+        int perm_kern = PTE_P | PTE_W | page_global;
+        int perm_user = PTE_U | PTE_P | page_global;
 
         int npage_roundup = ROUNDUP(npages * sizeof(struct PageInfo), PGSIZE);
         boot_map_region(kern_pgdir, UPAGES, npage_roundup, PADDR(pages), perm_user);
@@ -245,7 +282,7 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
-	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
 
 	check_page_free_list(0);
 
@@ -260,6 +297,19 @@ mem_init(void)
 	check_page_installed_pgdir();
 }
 
+// Enable the paging features kern_pgdir relies on and switch to it.
+// Every CPU runs this once it is executing above KERNBASE.
+//
+void
+mem_init_percpu(void)
+{
+	if (page_pse)
+		lcr4(rcr4() | CR4_PSE);
+	if (page_global)
+		lcr4(rcr4() | CR4_PGE);
+	lcr3(PADDR(kern_pgdir));
+}
+
 // Modify mappings in kern_pgdir to support SMP
 //   - Map the per-CPU stacks in the region [KSTACKTOP-PTSIZE, KSTACKTOP)
 //
@@ -285,21 +335,52 @@ mem_init_mp(void)
         int i;
         for (i = 0; i < NCPU; i++) {
            uintptr_t kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
-           boot_map_region(kern_pgdir, kstacktop_i - KSTKSIZE, KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_P | PTE_W);
+           boot_map_region(kern_pgdir, kstacktop_i - KSTKSIZE, KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_P | PTE_W | page_global);
         }
 }
 
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept by a buddy
+// allocator: blocks of 2^k pages, aligned to their size, on one free
+// list per order k.
 // --------------------------------------------------------------
 
+// Put the free block of 2^order pages at 'pp' on its free list.
+static void
+buddy_push(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_free = 1;
+	pp->pp_prev = NULL;
+	pp->pp_link = free_area[order];
+	if (free_area[order])
+		free_area[order]->pp_prev = pp;
+	free_area[order] = pp;
+	free_blocks[order]++;
+}
+
+// Take the free block at 'pp' off its free list.
+static void
+buddy_unlink(struct PageInfo *pp)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		free_area[pp->pp_order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	free_blocks[pp->pp_order]--;
+	pp->pp_free = 0;
+	pp->pp_link = pp->pp_prev = NULL;
+}
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the free lists.
 //
 void
 page_init(void)
@@ -330,19 +411,184 @@ page_init(void)
         size_t addr_IOPHYSMEM = ROUNDDOWN(IOPHYSMEM, PGSIZE)/PGSIZE;
         size_t addr_last = ROUNDUP(PADDR(boot_alloc(0)), PGSIZE)/PGSIZE;
         size_t addr_MPENTRY = MPENTRY_PADDR/PGSIZE;
-        page_free_list = NULL;
 
         for (i = 0; i < npages; i++) {
                 pages[i].pp_ref = 0;
+                pages[i].pp_free = 0;
+        }
+
+        // Free from the top down, so that the lowest blocks of each
+        // order end up first on their free lists: mem_init allocates
+        // page tables while only the bottom 4MB are mapped.
+        for (i = npages; i-- > 0; ) {
                 if (i == 0) { continue; }
                 if (i == addr_MPENTRY) { continue; }
                 if (i >= addr_IOPHYSMEM && i < addr_last)
                   { continue; }
-                pages[i].pp_link = page_free_list;
-                page_free_list = &pages[i];
+                page_free_npages(&pages[i], 0);
         }
 }
 
+//
+// Take a block of 2^order pages off the free lists, splitting a larger
+// block if need be.  Returns NULL if no block is large enough.
+// The caller holds page_lock.
+//
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int o;
+
+	for (o = order; o <= PAGE_MAX_ORDER && !free_area[o]; o++)
+		;
+	if (o > PAGE_MAX_ORDER)
+		return NULL;
+
+	pp = free_area[o];
+	buddy_unlink(pp);
+	// Keep the low half, free the high half, until small enough.
+	while (o > order) {
+		o--;
+		buddy_push(pp + (1 << o), o);
+	}
+	nfree_pages -= 1 << order;
+	return pp;
+}
+
+//
+// Put a block of 2^order pages back on the free lists, merging it with
+// its buddy for as long as the buddy is free.  The caller holds
+// page_lock.
+//
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t pn = pp - pages, bn;
+	struct PageInfo *buddy;
+
+	if (pp->pp_free)
+		panic("page_free_npages: page %08x is already free", page2pa(pp));
+	nfree_pages += 1 << order;
+
+	while (order < PAGE_MAX_ORDER) {
+		bn = pn ^ (1 << order);
+		if (bn + (1 << order) > npages)
+			break;
+		buddy = &pages[bn];
+		if (!buddy->pp_free || buddy->pp_order != order)
+			break;
+		buddy_unlink(buddy);
+		pn &= ~(1 << order);
+		order++;
+	}
+	buddy_push(&pages[pn], order);
+}
+
+//
+// Return a block of 2^order pages from page_alloc_npages to the free
+// lists.
+//
+void
+page_free_npages(struct PageInfo *pp, int order)
+{
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
+//
+// Give the pages cached in every CPU's magazine, and the pages waiting
+// in the zeroed pool, back to the buddy allocator, for a request the
+// free lists alone cannot meet.  Other CPUs have sent their TLB
+// shootdowns before releasing the big kernel lock, so their cached
+// pages are safe to hand out here.  The caller holds no allocator
+// lock.
+// Returns true if any pages came back.
+//
+static bool
+page_reclaim(void)
+{
+	struct CpuInfo *c;
+	bool found = 0;
+
+	for (c = cpus; c < cpus + NCPU; c++)
+		if (page_mag_flush(c))
+			found = 1;
+
+	spin_lock(&page_lock);
+	if (zero_pool_count)
+		found = 1;
+	while (zero_pool_count)
+		buddy_free(zero_pool[--zero_pool_count], 0);
+	spin_unlock(&page_lock);
+	return found;
+}
+
+//
+// Allocates a physically contiguous block of 2^order pages, aligned to
+// its size, splitting a larger free block if need be.  If
+// (alloc_flags & ALLOC_ZERO), fills the whole block with '\0' bytes.
+// Does NOT increment the reference count of any page.
+//
+// Returns NULL if order is out of range or no block is large enough.
+//
+struct PageInfo *
+page_alloc_npages(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	if (order < 0 || order > PAGE_MAX_ORDER)
+		return NULL;
+	tlb_shootdown();	// see page_alloc
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+	if (!pp && page_reclaim()) {
+		spin_lock(&page_lock);
+		pp = buddy_alloc(order);
+		spin_unlock(&page_lock);
+	}
+	if (!pp)
+		return NULL;
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), '\0', PGSIZE << order);
+	return pp;
+}
+
+//
+// Move up to PAGE_MAG_BATCH pages from the free lists into 'pm'.
+// The caller holds pm's lock; this takes page_lock.
+//
+static void
+page_mag_refill(struct PageMag *pm)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	while (pm->pm_count < PAGE_MAG_BATCH && (pp = buddy_alloc(0)))
+		pm->pm_pages[pm->pm_count++] = pp;
+	spin_unlock(&page_lock);
+}
+
+//
+// Take a page from the zeroed pool, or return NULL if it is empty.
+//
+static struct PageInfo *
+zero_pool_get(void)
+{
+	struct PageInfo *pp = NULL;
+
+	spin_lock(&page_lock);
+	if (zero_pool_count) {
+		zero_pool_hits++;
+		pp = zero_pool[--zero_pool_count];
+	}
+	spin_unlock(&page_lock);
+	return pp;
+}
+
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
 // returned physical page with '\0' bytes.  Does NOT increment the reference
@@ -359,13 +605,47 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-        struct PageInfo *retPage = page_free_list;
-        if (!page_free_list) { return NULL; }
-        if (alloc_flags && ALLOC_ZERO) {
+        struct PageMag *pm = &thiscpu->cpu_pagemag;
+        struct PageInfo *retPage = NULL;
+        bool reclaimed = 0;
+
+        // Other CPUs may still map pages we freed.
+        tlb_shootdown();
+
+        // Idle CPUs keep a pool of zeroed pages so that we rarely
+        // have to clear one here.
+        if ((alloc_flags & ALLOC_ZERO) && zero_pool_count &&
+            (retPage = zero_pool_get())) {
+            return retPage;
+        }
+
+        // Served from this CPU's magazine, refilled in a batch when
+        // it runs dry.  If the free lists are empty too, the last free
+        // pages may be sitting in other CPUs' magazines.
+    retry:
+        spin_lock(&pm->pm_lock);
+        if (pm->pm_count) {
+            pm->pm_hits++;
+        } else {
+            pm->pm_refills++;
+            page_mag_refill(pm);
+        }
+        if (pm->pm_count) {
+            retPage = pm->pm_pages[--pm->pm_count];
+        }
+        spin_unlock(&pm->pm_lock);
+        if (!retPage) {
+            if (!reclaimed && page_reclaim()) {
+                reclaimed = 1;
+                goto retry;
+            }
+            return NULL;
+        }
+
+        if (alloc_flags & ALLOC_ZERO) {
+           zero_pool_misses++;
            memset(page2kva(retPage), '\0', PGSIZE);
         }
-        page_free_list = page_free_list-> pp_link;
-        retPage->pp_link = NULL;
 
         return retPage;
 }
@@ -380,11 +660,144 @@ page_free(struct PageInfo *pp)
 	// Fill this function in
 	// Hint: You may want to panic if pp->pp_ref is nonzero or
 	// pp->pp_link is not NULL.
+        struct PageMag *pm = &thiscpu->cpu_pagemag;
+        int i;
+
+        if (!pp || pp->pp_ref != 0) { return; }
+        if (pp->pp_free) {
+            panic("page_free: page %08x is already free", page2pa(pp));
+        }
 
-        if (pp && (pp->pp_ref == 0)) {
-            pp -> pp_link = page_free_list;
-            page_free_list = pp;
+        // A full magazine gives its coldest batch back to the buddy
+        // allocator.
+        spin_lock(&pm->pm_lock);
+        if (pm->pm_count < PAGE_MAG_SIZE) {
+            pm->pm_hits++;
+        } else {
+            pm->pm_drains++;
+            spin_lock(&page_lock);
+            for (i = 0; i < PAGE_MAG_BATCH; i++)
+                buddy_free(pm->pm_pages[i], 0);
+            spin_unlock(&page_lock);
+            memmove(pm->pm_pages, pm->pm_pages + PAGE_MAG_BATCH,
+                    (PAGE_MAG_SIZE - PAGE_MAG_BATCH) * sizeof(pm->pm_pages[0]));
+            pm->pm_count -= PAGE_MAG_BATCH;
         }
+        pm->pm_pages[pm->pm_count++] = pp;
+        spin_unlock(&pm->pm_lock);
+}
+
+//
+// Give all pages cached in 'c's magazine back to the buddy allocator.
+// Returns the number of pages given back.
+//
+int
+page_mag_flush(struct CpuInfo *c)
+{
+	struct PageMag *pm = &c->cpu_pagemag;
+	int n;
+
+	spin_lock(&pm->pm_lock);
+	spin_lock(&page_lock);
+	n = pm->pm_count;
+	while (pm->pm_count)
+		buddy_free(pm->pm_pages[--pm->pm_count], 0);
+	spin_unlock(&page_lock);
+	spin_unlock(&pm->pm_lock);
+	return n;
+}
+
+//
+// Clear a page.  Non-temporal stores keep the zeroes from evicting the
+// cache of whoever uses the page first, which is likely not this CPU.
+//
+static void
+page_zero(struct PageInfo *pp)
+{
+	static int use_movnti = -1;
+	uint32_t *p = page2kva(pp), *end = p + PGSIZE / sizeof(*p);
+	uint32_t edx;
+
+	if (use_movnti < 0) {
+		// movnti is part of SSE2
+		cpuid(1, NULL, NULL, NULL, &edx);
+		use_movnti = (edx & (1 << 26)) != 0;
+	}
+	if (!use_movnti) {
+		memset(p, 0, PGSIZE);
+		return;
+	}
+	for (; p < end; p += 4)
+		asm volatile("movnti %1, 0(%0)\n\t"
+			     "movnti %1, 4(%0)\n\t"
+			     "movnti %1, 8(%0)\n\t"
+			     "movnti %1, 12(%0)"
+			     : : "r" (p), "r" (0) : "memory");
+	// Order the stores before the page is published.
+	asm volatile("sfence" : : : "memory");
+}
+
+//
+// Whether some CPU has queued TLB invalidations it has not yet sent.
+// Only the holder of the big kernel lock can have any.
+//
+static bool
+tlb_shootdown_pending(void)
+{
+	struct CpuInfo *c;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c->cpu_tlb_out.tb_pgdir)
+			return 1;
+	return 0;
+}
+
+//
+// Called by idle CPUs, without the big kernel lock.  Tops up the pool
+// of zeroed pages handed out by page_alloc(ALLOC_ZERO), a batch at a
+// time so that a wakeup is not kept waiting for long.
+//
+void
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+	int i;
+
+	for (i = 0; i < ZERO_POOL_BATCH; i++) {
+		// Leave the last free pages for real allocations.  Pages
+		// freed before a pending shootdown may still be written
+		// through other CPUs' TLBs (see page_alloc), so leave the
+		// free lists alone until it has been sent.
+		pp = NULL;
+		spin_lock(&page_lock);
+		if (zero_pool_count < ZERO_POOL_SIZE
+		    && nfree_pages >= ZERO_POOL_SIZE
+		    && !tlb_shootdown_pending())
+			pp = buddy_alloc(0);
+		spin_unlock(&page_lock);
+		if (!pp)
+			break;
+
+		page_zero(pp);
+
+		spin_lock(&page_lock);
+		if (zero_pool_count < ZERO_POOL_SIZE)
+			zero_pool[zero_pool_count++] = pp;
+		else
+			buddy_free(pp, 0);
+		spin_unlock(&page_lock);
+	}
+}
+
+//
+// Return the number of free blocks of 2^order pages.
+//
+size_t
+page_nfree_blocks(int order)
+{
+	if (order < 0 || order > PAGE_MAX_ORDER)
+		return 0;
+	return free_blocks[order];
 }
 
 //
@@ -420,6 +833,9 @@ page_decref(struct PageInfo* pp)
 // Hint 3: look at inc/mmu.h for useful macros that mainipulate page
 // table and page directory entries.
 //
+// If 'va' lies in a 4MB page (PTE_PS), there is no PTE for it and
+// pgdir_walk returns NULL.
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
@@ -427,6 +843,7 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
         pde_t pt_entry =  pgdir[PDX(va)];
         pte_t *pt_addr;
 
+        if (pt_entry & PTE_PS) { return NULL; }
         if (pt_entry & PTE_P) { // page is present
               pt_addr = (pte_t *) KADDR(PTE_ADDR(pt_entry));
               return &pt_addr[PTX(va)];
@@ -455,18 +872,31 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
 //
+// Where va and pa are both 4MB-aligned and at least 4MB remain, a
+// single 4MB page directory entry is used instead of a page table.
+//
 // Hint: the TA solution uses pgdir_walk
 static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
 {
 	// Fill this function in
         pte_t *pg_entry;
-        int cntpages;
-        for (cntpages = 0; cntpages < size/PGSIZE; cntpages++) {
+        size_t left = ROUNDDOWN(size, PGSIZE);
+
+        while (left) {
+           if (page_pse && left >= PTSIZE && va % PTSIZE == 0
+               && pa % PTSIZE == 0 && !(pgdir[PDX(va)] & PTE_P)) {
+              pgdir[PDX(va)] = pa | perm | PTE_PS | PTE_P;
+              va += PTSIZE;
+              pa += PTSIZE;
+              left -= PTSIZE;
+              continue;
+           }
            pg_entry = pgdir_walk(pgdir, (void *) va, 1);
            *pg_entry = pa | perm | PTE_P;
            va += PGSIZE;
            pa += PGSIZE;
+           left -= PGSIZE;
         }
 }
 
@@ -491,6 +921,7 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if va lies in a 4MB page
 //
 // Hint: The TA solution is implemented using pgdir_walk, page_remove,
 // and page2pa.
@@ -499,6 +930,8 @@ int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
         // Fill this function in
+        if (pgdir[PDX(va)] & PTE_PS) { return -E_INVAL; }
+
         pte_t *pt_entry = pgdir_walk(pgdir, va, 1);
         if (!pt_entry) { return -E_NO_MEM; }
 
@@ -574,16 +1007,209 @@ page_remove(pde_t *pgdir, void *va)
         }
 }
 
+//
+// Resolve a write fault at 'va' on a copy-on-write (PTE_COW) user
+// page: map a private writable copy there, or, if nothing else maps
+// the page any more, just make it writable.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if 'va' is not a copy-on-write user page
+//   -E_NO_MEM, if there was no page for the copy
+//
+int
+page_cow_fault(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *copy;
+	pte_t *pte;
+	int perm, r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((uintptr_t) va >= UTOP || !(pp = page_lookup(pgdir, va, &pte))
+	    || !(*pte & PTE_COW))
+		return -E_INVAL;
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+
+	if (pp->pp_ref == 1) {
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+	if (!(copy = page_alloc(0)))
+		return -E_NO_MEM;
+	memmove(page2kva(copy), page2kva(pp), PGSIZE);
+	if ((r = page_insert(pgdir, copy, va, perm)) < 0) {
+		page_free(copy);
+		return r;
+	}
+	return 0;
+}
+
+//
+// 4MB pages: a block from page_alloc_npages(PAGE_MAX_ORDER, ...)
+// mapped by one page directory entry with PTE_PS set.  The reference
+// count is kept in the block's first PageInfo.  The functions above
+// do not see into large pages.
+//
+
+//
+// Return the large page mapped at virtual address 'va', or NULL if
+// 'va' is not in one.  If pde_store is not zero, store in it the
+// address of the page directory entry.
+//
+struct PageInfo *
+page_lookup_large(pde_t *pgdir, void *va, pde_t **pde_store)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+
+	if ((*pde & (PTE_P | PTE_PS)) != (PTE_P | PTE_PS))
+		return NULL;
+	if (pde_store)
+		*pde_store = pde;
+	return pa2page(PTE_ADDR(*pde));
+}
+
+//
+// Unmap the large page containing 'va', freeing it if this was the
+// last reference.  Silently does nothing if there is none.
+//
+void
+page_remove_large(pde_t *pgdir, void *va)
+{
+	pde_t *pde;
+	struct PageInfo *pp = page_lookup_large(pgdir, va, &pde);
+
+	if (!pp)
+		return;
+	*pde = 0;
+	if (--pp->pp_ref == 0)
+		page_free_npages(pp, PAGE_MAX_ORDER);
+	tlb_invalidate(pgdir, va);
+}
+
+//
+// Map the large page 'pp' at the 4MB-aligned 'va' with permissions
+// 'perm|PTE_PS|PTE_P'.  Anything mapped in [va, va+PTSIZE) before is
+// unmapped, and the page table that mapped it freed.
+//
+void
+page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	pte_t *pt;
+	int i;
+
+	// Take the new reference first, in case pp is already mapped here.
+	pp->pp_ref++;
+	if (*pde & PTE_PS)
+		page_remove_large(pgdir, va);
+	else if (*pde & PTE_P) {
+		pt = (pte_t *) KADDR(PTE_ADDR(*pde));
+		for (i = 0; i < NPTENTRIES; i++)
+			if (pt[i] & PTE_P)
+				page_remove(pgdir, (char *) va + i * PGSIZE);
+		page_decref(pa2page(PTE_ADDR(*pde)));
+	}
+	*pde = page2pa(pp) | perm | PTE_PS | PTE_P;
+}
+
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// Other CPUs running 'pgdir' are told by tlb_shootdown, in batches.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+	struct TlbBatch *out = &thiscpu->cpu_tlb_out;
+	struct CpuInfo *c;
+
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != thiscpu && c->cpu_pgdir == pgdir)
+			break;
+	if (c == cpus + ncpu)
+		return;
+	if (out->tb_pgdir != pgdir)
+		tlb_shootdown();
+	out->tb_pgdir = pgdir;
+	if (out->tb_n < TLB_BATCH)
+		out->tb_va[out->tb_n] = (uintptr_t) va;
+	if (out->tb_n <= TLB_BATCH)
+		out->tb_n++;
+}
+
+//
+// Send the invalidations queued by tlb_invalidate, with one IPI to
+// each CPU running that address space, and wait until they are done.
+// Must be called before pages freed since the last call are reused
+// and before the big kernel lock is released: holding the lock keeps
+// other CPUs from loading the page directory in the meantime.
+//
+void
+tlb_shootdown(void)
+{
+	struct TlbBatch *out = &thiscpu->cpu_tlb_out, *in;
+	struct CpuInfo *c;
+	int i;
+
+	if (!out->tb_pgdir)
+		return;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu || c->cpu_pgdir != out->tb_pgdir)
+			continue;
+		in = &c->cpu_tlb_in;
+		spin_lock(&c->cpu_tlb_lock);
+		if (!c->cpu_tlb_pending) {
+			*in = *out;
+		} else if (in->tb_pgdir == out->tb_pgdir
+			   && in->tb_n + out->tb_n <= TLB_BATCH) {
+			for (i = 0; i < out->tb_n; i++)
+				in->tb_va[in->tb_n++] = out->tb_va[i];
+		} else {
+			in->tb_n = TLB_BATCH + 1;
+		}
+		c->cpu_tlb_pending = 1;
+		spin_unlock(&c->cpu_tlb_lock);
+		lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_TLBFLUSH);
+	}
+
+	// A CPU that has left user mode is spinning on the big kernel
+	// lock with interrupts off, and applies the batch once it gets
+	// the lock (see trap).  Only wait for the others.
+	for (c = cpus; c < cpus + ncpu; c++)
+		while (c->cpu_tlb_pending && c->cpu_in_user)
+			asm volatile("pause");
+
+	out->tb_pgdir = NULL;
+	out->tb_n = 0;
+}
+
+//
+// Apply the invalidations other CPUs have sent this one.
+//
+void
+tlb_shootdown_recv(void)
+{
+	struct CpuInfo *c = thiscpu;
+	struct TlbBatch *in = &c->cpu_tlb_in;
+	int i;
+
+	spin_lock(&c->cpu_tlb_lock);
+	if (c->cpu_tlb_pending) {
+		if (in->tb_n > TLB_BATCH)
+			tlbflush();
+		else if (in->tb_pgdir == c->cpu_pgdir)
+			// (after switching away, the CR3 load flushed them)
+			for (i = 0; i < in->tb_n; i++)
+				invlpg((void *) in->tb_va[i]);
+		c->cpu_tlb_pending = 0;
+	}
+	spin_unlock(&c->cpu_tlb_lock);
 }
 
 //
@@ -624,7 +1250,7 @@ mmio_map_region(physaddr_t pa, size_t size)
 
         int size_up = ROUNDUP(size, PGSIZE);
 
-        boot_map_region(kern_pgdir, base, size_up, pa, PTE_PCD|PTE_PWT|PTE_W);
+        boot_map_region(kern_pgdir, base, size_up, pa, PTE_PCD|PTE_PWT|PTE_W|page_global);
         base += size_up;
 
         return (void *) (base - size_up);
@@ -659,7 +1285,10 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
         perm = perm | PTE_P;
 
         for (; va_check < va_end ; va_check += PGSIZE) {
-            pte_t *pte = pgdir_walk(env->env_pgdir, (void *)va_check, 0);
+            pde_t *pde = &env->env_pgdir[PDX(va_check)];
+            // a 4MB page's permissions are in its pde
+            pte_t *pte = (*pde & PTE_PS) ? pde :
+                         pgdir_walk(env->env_pgdir, (void *)va_check, 0);
             perm = perm | PTE_P;
             if (va_check >= ULIM || !pte || ((*pte & perm) != perm) )
             {
@@ -694,66 +1323,105 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the pages on the free lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *pp, *p;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
-	int nfree_basemem = 0, nfree_extmem = 0;
+	int nfree_basemem = 0, nfree_extmem = 0, o;
+	size_t nblocks, nfree = 0;
 	char *first_free_page;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
+	if (!nfree_pages)
+		panic("no free pages!");
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		for (pp = free_area[o]; pp; pp = pp->pp_link)
+			for (p = pp; p < pp + (1 << o); p++)
+				if (PDX(page2pa(p)) < pdx_limit)
+					memset(page2kva(p), 0x97, 128);
+
+	// The first pages handed out must be mapped by entry_pgdir.
+	if (only_low_memory) {
+		for (o = 0; o <= PAGE_MAX_ORDER && !free_area[o]; o++)
+			;
+		assert(o > PAGE_MAX_ORDER || PDX(page2pa(free_area[o])) < pdx_limit);
+	}
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+	for (o = 0; o <= PAGE_MAX_ORDER; o++) {
+		nblocks = 0;
+		for (pp = free_area[o]; pp; pp = pp->pp_link) {
+			// check that we didn't corrupt the free lists
+			assert(pp >= pages);
+			assert(pp + (1 << o) <= pages + npages);
+			assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
+			assert((pp - pages) % (1 << o) == 0);
+			assert(pp->pp_free && pp->pp_order == o);
+			assert(!pp->pp_link || pp->pp_link->pp_prev == pp);
+			nblocks++;
+
+			for (p = pp; p < pp + (1 << o); p++) {
+				// check a few pages that shouldn't be on the free list
+				assert(page2pa(p) != 0);
+				assert(page2pa(p) != IOPHYSMEM);
+				assert(page2pa(p) != EXTPHYSMEM - PGSIZE);
+				assert(page2pa(p) != EXTPHYSMEM);
+				assert(page2pa(p) < EXTPHYSMEM || (char *) page2kva(p) >= first_free_page);
+				// (new test for lab 4)
+				assert(page2pa(p) != MPENTRY_PADDR);
+
+				if (page2pa(p) < EXTPHYSMEM)
+					++nfree_basemem;
+				else
+					++nfree_extmem;
+			}
+		}
+		assert(nblocks == free_blocks[o]);
+		nfree += nblocks << o;
 	}
 
+	assert(nfree == nfree_pages);
 	assert(nfree_basemem > 0);
 	assert(nfree_extmem > 0);
 }
 
+// Allocate every free page, so that tests can run with no free memory.
+// Returns the blocks taken, linked through pp_link, with their order
+// in pp_order.
+static struct PageInfo *
+check_steal_free(void)
+{
+	struct PageInfo *pp, *fl = NULL;
+	int o;
+
+	page_mag_flush(thiscpu);
+	for (o = PAGE_MAX_ORDER; o >= 0; o--)
+		while ((pp = page_alloc_npages(o, 0))) {
+			pp->pp_order = o;
+			pp->pp_link = fl;
+			fl = pp;
+		}
+	return fl;
+}
+
+// Give back the blocks taken by check_steal_free.
+static void
+check_return_free(struct PageInfo *fl)
+{
+	struct PageInfo *pp;
+
+	while ((pp = fl)) {
+		fl = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free_npages(pp, pp->pp_order);
+	}
+}
+
 //
 // Check the physical page allocator (page_alloc(), page_free(),
 // and page_init()).
@@ -771,8 +1439,8 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	page_mag_flush(thiscpu);
+	nfree = nfree_pages;
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -788,8 +1456,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -817,7 +1484,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -825,9 +1492,28 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	page_mag_flush(thiscpu);
+	assert(nfree == nfree_pages);
+
+	// multi-page blocks are aligned to their size, and freeing
+	// their pages one by one merges them back into one block
+	assert((pp0 = page_alloc_npages(3, 0)));
+	assert((pp0 - pages) % 8 == 0);
+	assert(nfree_pages == nfree - 8);
+	fl = check_steal_free();
+	for (i = 0; i < 8; i++)
+		page_free_npages(&pp0[i], 0);
+	assert(page_nfree_blocks(3) == 1 && page_nfree_blocks(0) == 0);
+	memset(page2kva(pp0), 1, 8 * PGSIZE);
+	assert((pp = page_alloc_npages(3, ALLOC_ZERO)) && pp == pp0);
+	c = page2kva(pp);
+	for (i = 0; i < 8 * PGSIZE; i++)
+		assert(c[i] == 0);
+	assert(!page_alloc(0));
+	page_free_npages(pp, 3);
+	check_return_free(fl);
+	assert(nfree == nfree_pages);
+	assert(!page_alloc_npages(PAGE_MAX_ORDER + 1, 0));
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -908,6 +1594,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_ADDR(*pgdir) + PTX(va) * PGSIZE;
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -938,8 +1626,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1059,7 +1746,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free(fl);
 
 	// free the pages we took
 	page_free(pp0);
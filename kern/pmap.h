@@ -9,12 +9,17 @@
 #include <inc/memlayout.h>
 #include <inc/assert.h>
 struct Env;
+struct CpuInfo;
 
 extern char bootstacktop[], bootstack[];
 
 extern struct PageInfo *pages;
 extern size_t npages;
 
+extern bool page_pse;
+extern int zero_pool_count;
+extern uint32_t zero_pool_hits, zero_pool_misses;
+
 extern pde_t *kern_pgdir;
 
 
@@ -52,16 +57,37 @@ enum {
 };
 
 void	mem_init(void);
+void	mem_init_percpu(void);
+
+// Largest block handed out by the buddy allocator: 2^PAGE_MAX_ORDER
+// pages (4MB), aligned to its size.
+#define PAGE_MAX_ORDER	10
+
+// Pages kept zeroed by idle CPUs, and how many they clear at a time.
+#define ZERO_POOL_SIZE	64
+#define ZERO_POOL_BATCH	8
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_npages(int order, int alloc_flags);
+void	page_free_npages(struct PageInfo *pp, int order);
+size_t	page_nfree_blocks(int order);
+int	page_mag_flush(struct CpuInfo *c);
+void	page_zero_idle(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+int	page_cow_fault(pde_t *pgdir, void *va);
+
+struct PageInfo *page_lookup_large(pde_t *pgdir, void *va, pde_t **pde_store);
+void	page_remove_large(pde_t *pgdir, void *va);
+void	page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_shootdown(void);
+void	tlb_shootdown_recv(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
@@ -1,15 +1,17 @@
 // Simple implementation of cprintf console output for the kernel,
-// based on printfmt() and the kernel console's cputchar().
+// based on printfmt() and the kernel console's cons_putc().
 
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/console.h>
+
 
 static void
 putch(int ch, int *cnt)
 {
-	cputchar(ch);
+	cons_putc(ch);
 	*cnt++;
 }
 
@@ -18,7 +20,10 @@ vcprintf(const char *fmt, va_list ap)
 {
 	int cnt = 0;
 
+	// Hold the console for the whole message.
+	lock_console();
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	unlock_console();
 	return cnt;
 }
 
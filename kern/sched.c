@@ -5,59 +5,344 @@
 #include <kern/pmap.h>
 #include <kern/monitor.h>
 
+void sched_yield(void);
 void sched_halt(void);
+void sched_idle(void);
+void sched_charge(struct Env *e);
 
-// Choose a user environment to run and run it.
+// How far behind the queue's min_vruntime a waking env may be placed,
+// in weighted TSC cycles.  This is the credit an env gets for having
+// slept: envs that block often (servers waiting in sys_ipc_recv) get
+// to run ahead of CPU-bound envs when they wake up.
+#define SCHED_WAKEUP_CREDIT	(1ULL << 22)
+
+// Weight of each nice value, indexed by priority - ENV_PRIO_MIN.
+// Priority 0 weighs 1024 and each step is a factor of about 1.25.
+static const uint32_t prio_weight[ENV_PRIO_MAX - ENV_PRIO_MIN + 1] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	 9548,  7620,  6100,  4904,  3906,
+	 3121,  2501,  1991,  1586,  1277,
+	 1024,   820,   655,   526,   423,
+	  335,   272,   215,   172,   137,
+	  110,    87,    70,    56,    45,
+	   36,    29,    23,    18,    15,
+};
+
+// Compare vruntimes in a way that survives wraparound.
+static inline bool
+vruntime_before(uint64_t a, uint64_t b)
+{
+	return (int64_t) (a - b) < 0;
+}
+
+// Insert e into run queue rq, keeping the queue sorted by vruntime.
+// Envs with equal vruntime stay in FIFO order.  We search from the
+// tail because a preempted env has usually run the most.
+// The rq_ functions expect the caller to hold the queue's rq_lock.
+static void
+rq_push(struct RunQueue *rq, struct Env *e, int cpu)
+{
+	struct Env *prev = rq->rq_tail;
+
+	while (prev && vruntime_before(e->env_vruntime, prev->env_vruntime))
+		prev = prev->env_rq_prev;
+
+	e->env_rq_prev = prev;
+	e->env_rq_next = prev ? prev->env_rq_next : rq->rq_head;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e;
+	else
+		rq->rq_tail = e;
+	if (prev)
+		prev->env_rq_next = e;
+	else
+		rq->rq_head = e;
+	rq->rq_len++;
+	e->env_rq_cpu = cpu;
+}
+
+// Unlink e from run queue rq.
+static void
+rq_unlink(struct RunQueue *rq, struct Env *e)
+{
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rq->rq_head = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rq->rq_tail = e->env_rq_prev;
+	e->env_rq_next = e->env_rq_prev = NULL;
+	rq->rq_len--;
+	e->env_rq_cpu = -1;
+}
+
+// Remove and return the env at the head of rq, or NULL if rq is empty.
+// The head has the smallest vruntime on the queue, so it also advances
+// the queue's min_vruntime.
+static struct Env *
+rq_pop(struct RunQueue *rq)
+{
+	struct Env *e = rq->rq_head;
+
+	if (e) {
+		rq_unlink(rq, e);
+		if (vruntime_before(rq->rq_min_vruntime, e->env_vruntime))
+			rq->rq_min_vruntime = e->env_vruntime;
+	}
+	return e;
+}
+
+// Move e from run queue 'from' to run queue 'to' (owned by CPU 'cpu'),
+// rebasing its vruntime onto the new queue's clock.
+static void
+rq_move(struct RunQueue *from, struct RunQueue *to, struct Env *e, int cpu)
+{
+	rq_unlink(from, e);
+	e->env_vruntime += to->rq_min_vruntime - from->rq_min_vruntime;
+	rq_push(to, e, cpu);
+}
+
+// Advance rq's min_vruntime to the least vruntime among the envs on it
+// and 'cur', the env running on its CPU, so that waking envs are
+// placed relative to what is actually running.
+static void
+rq_advance_min(struct RunQueue *rq, struct Env *cur)
+{
+	uint64_t min = cur->env_vruntime;
+
+	if (rq->rq_head && vruntime_before(rq->rq_head->env_vruntime, min))
+		min = rq->rq_head->env_vruntime;
+	if (vruntime_before(rq->rq_min_vruntime, min))
+		rq->rq_min_vruntime = min;
+}
+
+// Lock two run queues, in CPU order so that two CPUs locking the same
+// pair cannot deadlock.
+static void
+rq_lock_pair(struct RunQueue *a, struct RunQueue *b)
+{
+	if (a > b) {
+		struct RunQueue *t = a;
+		a = b;
+		b = t;
+	}
+	spin_lock(&a->rq_lock);
+	spin_lock(&b->rq_lock);
+}
+
+// Mark e ENV_RUNNABLE and put it on a run queue.  An env that has run
+// before goes back to the CPU it last ran on; a new env is queued on
+// this CPU.  Does nothing if e is already queued or running.
+// If e lands on this CPU's queue owing more CPU time than curenv, it
+// preempts curenv when the current trap is done (see trap).
+void
+sched_wakeup(struct Env *e)
+{
+	struct RunQueue *rq;
+	struct Env *cur = NULL;
+	uint64_t floor;
+	int cpu;
+
+	if (e->env_status == ENV_RUNNING || e->env_rq_cpu >= 0)
+		return;
+	e->env_status = ENV_RUNNABLE;
+	cpu = e->env_runs > 0 ? e->env_cpunum : thiscpu->cpu_id;
+	rq = &cpus[cpu].cpu_rq;
+	if (cpu == thiscpu->cpu_id && curenv
+	    && curenv->env_status == ENV_RUNNING)
+		cur = curenv;
+
+	// New envs start level with the queue.  Sleepers keep what they
+	// are owed, but no more than SCHED_WAKEUP_CREDIT, so a long
+	// sleep cannot be traded for a long monopoly of the CPU.
+	spin_lock(&rq->rq_lock);
+	if (cur) {
+		sched_charge(cur);
+		rq_advance_min(rq, cur);
+	}
+	floor = rq->rq_min_vruntime - SCHED_WAKEUP_CREDIT;
+	if (e->env_runs == 0)
+		e->env_vruntime = rq->rq_min_vruntime;
+	else if (vruntime_before(e->env_vruntime, floor))
+		e->env_vruntime = floor;
+	rq_push(rq, e, cpu);
+	if (cur && vruntime_before(e->env_vruntime, cur->env_vruntime))
+		thiscpu->cpu_resched = 1;
+	spin_unlock(&rq->rq_lock);
+}
+
+// Put curenv, which was ENV_RUNNING and has been charged for its time,
+// back on this CPU's run queue.
+void
+sched_preempt(struct Env *e)
+{
+	struct RunQueue *rq = &thiscpu->cpu_rq;
+
+	e->env_status = ENV_RUNNABLE;
+	spin_lock(&rq->rq_lock);
+	rq_push(rq, e, thiscpu->cpu_id);
+	spin_unlock(&rq->rq_lock);
+}
+
+// Take e off whatever run queue holds it.  The caller is expected to
+// give e a new, non-runnable status.
+void
+sched_remove(struct Env *e)
+{
+	struct RunQueue *rq;
+	int cpu;
+
+	// A steal can move e to another queue until we hold the lock of
+	// the one it is on.
+	while ((cpu = e->env_rq_cpu) >= 0) {
+		rq = &cpus[cpu].cpu_rq;
+		spin_lock(&rq->rq_lock);
+		if (e->env_rq_cpu == cpu) {
+			rq_unlink(rq, e);
+			spin_unlock(&rq->rq_lock);
+			return;
+		}
+		spin_unlock(&rq->rq_lock);
+	}
+}
+
+// Remove and return the env at the head of this CPU's run queue, or
+// NULL if it is empty.
+static struct Env *
+sched_next(void)
+{
+	struct RunQueue *rq = &thiscpu->cpu_rq;
+	struct Env *e;
+
+	spin_lock(&rq->rq_lock);
+	e = rq_pop(rq);
+	spin_unlock(&rq->rq_lock);
+	return e;
+}
+
+// Whether any run queue has an env waiting.  The queue lengths are
+// read without their locks, so this is only a hint: an idle CPU uses
+// it to decide whether to take the big kernel lock and look properly.
+bool
+sched_runnable(void)
+{
+	int i;
+
+	if (thiscpu->cpu_rq.rq_len)
+		return 1;
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_rq.rq_len)
+			return 1;
+	return 0;
+}
+
+// Charge e, which is running on this CPU, for the TSC cycles it ran
+// since it was switched in or last charged, scaled by the weight of
+// its priority.
+void
+sched_charge(struct Env *e)
+{
+	uint64_t now = read_tsc();
+	uint64_t delta = now - e->env_runstart;
+
+	e->env_vruntime += delta * prio_weight[-ENV_PRIO_MIN] /
+		prio_weight[e->env_priority - ENV_PRIO_MIN];
+	e->env_runstart = now;
+}
+
+// Try to take work from another CPU's run queue for this idle CPU.
+// The victim is the peer with the longest queue; we move up to half of
+// its envs onto our own queue, preferring envs that last ran here so
+// their cache state is still warm, and fill up from the victim's tail
+// (the envs it would run last).  Returns the number of envs stolen.
+static int
+sched_steal(void)
+{
+	struct RunQueue *victim = NULL, *rq = &thiscpu->cpu_rq;
+	struct Env *e, *next;
+	int i, me = thiscpu->cpu_id, n, stolen = 0;
+
+	for (i = 0; i < ncpu; i++)
+		if (i != me && cpus[i].cpu_rq.rq_len > 0 &&
+		    (!victim || cpus[i].cpu_rq.rq_len > victim->rq_len))
+			victim = &cpus[i].cpu_rq;
+	if (!victim)
+		return 0;
+
+	// The lengths above were read unlocked; the victim may have
+	// emptied since.
+	rq_lock_pair(rq, victim);
+	n = (victim->rq_len + 1) / 2;
+
+	for (e = victim->rq_head; e && stolen < n; e = next) {
+		next = e->env_rq_next;
+		if (e->env_runs > 0 && e->env_cpunum == me) {
+			rq_move(victim, rq, e, me);
+			stolen++;
+		}
+	}
+	while (stolen < n && (e = victim->rq_tail)) {
+		rq_move(victim, rq, e, me);
+		stolen++;
+	}
+	spin_unlock(&victim->rq_lock);
+	spin_unlock(&rq->rq_lock);
+
+	thiscpu->cpu_steals += stolen;
+	return stolen;
+}
+
+// Called on a clock tick, and after a trap in which sched_wakeup
+// queued an env that is owed more CPU time than curenv.  Switches to
+// the head of this CPU's run queue only if it is further behind its
+// fair share than curenv, so that a higher-priority env keeps the CPU
+// for proportionally more ticks.  This function does not return.
+void
+sched_tick(void)
+{
+	struct RunQueue *rq = &thiscpu->cpu_rq;
+	struct Env *e = NULL;
+
+	if (!curenv || curenv->env_status != ENV_RUNNING)
+		sched_yield();
+	thiscpu->cpu_resched = 0;
+
+	sched_charge(curenv);
+	spin_lock(&rq->rq_lock);
+	rq_advance_min(rq, curenv);
+	if (rq->rq_head
+	    && vruntime_before(rq->rq_head->env_vruntime, curenv->env_vruntime))
+		e = rq_pop(rq);
+	spin_unlock(&rq->rq_lock);
+	env_run(e ? e : curenv);
+}
+
+// Choose a user environment to run and run it.  Unlike sched_tick,
+// this gives up the CPU to any queued env: curenv is blocking or has
+// asked to yield.
 void
 sched_yield(void)
 {
-	struct Env *idle;
+	struct Env *e;
+
+	thiscpu->cpu_resched = 0;
+
+	// Run the env at the head of this CPU's run queue: the one with
+	// the least weighted run time.  env_run() charges the env we are
+	// switching away from and re-queues it by its new vruntime.
+	// Envs on the queue are ENV_RUNNABLE and never running on
+	// another CPU.
+	if ((e = sched_next()))
+		env_run(e);
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
 	// If no envs are runnable, but the environment previously
 	// running on this CPU is still ENV_RUNNING, it's okay to
 	// choose that environment.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-        int i;
-        int env_offset;
-
-        int count = 0;
-        for (i = 0; i < NENV; i++) {
-           if ((envs[i].env_type == ENV_TYPE_FS))  
-              count++; 
-        }
-
-        if (thiscpu->cpu_env == NULL) {
-            env_offset = NENV - 1;
-        }
-        else {
-            env_offset = ENVX(thiscpu->cpu_env->env_id);
-        }
-
-        for (i = (env_offset + 1) % NENV; i != env_offset; i = (i + 1) % NENV) {
-            if (envs[i].env_status == ENV_RUNNABLE) {
-                break;
-            }
-        }
-
-        if (i != env_offset) {
-            env_run(&envs[i]);
-        }
-        else if (curenv && (curenv->env_status == ENV_RUNNING) &&
-                (&envs[i] == thiscpu->cpu_env)) {
-                env_run(&envs[i]);
-        }
+	if (curenv && curenv->env_status == ENV_RUNNING)
+		env_run(curenv);
 
 	// sched_halt never returns
 	sched_halt();
@@ -69,8 +354,13 @@ sched_yield(void)
 void
 sched_halt(void)
 {
+	struct Env *e;
 	int i;
 
+	// Before going idle, look for work queued on a busier CPU.
+	if (sched_steal() > 0 && (e = sched_next()))
+		env_run(e);
+
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
 	for (i = 0; i < NENV; i++) {
@@ -86,17 +376,33 @@ sched_halt(void)
 	}
 
 	// Mark that no environment is running on this CPU
-	curenv = NULL;
+	if (curenv)
+		sched_charge(curenv);
+	cpu_set_curenv(NULL);
 	lcr3(PADDR(kern_pgdir));
+	thiscpu->cpu_pgdir = kern_pgdir;
+
+	// Release the big kernel lock as if we were "leaving" the kernel
+	tlb_shootdown();
+	unlock_kernel();
+
+	sched_idle();
+}
+
+// Wait for work on this CPU, which holds no locks.  Clock interrupts
+// that find every run queue empty come straight back here without
+// taking the big kernel lock (see trap).  This function never returns.
+void
+sched_idle(void)
+{
+	// Use the idle time to clear pages for later allocations.
+	page_zero_idle();
 
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
 	// big kernel lock
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
-
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
 		"movl $0, %%ebp\n"
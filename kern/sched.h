@@ -6,7 +6,20 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+struct Env;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_tick(void);
+void sched_idle(void);
+bool sched_runnable(void);
+
+void sched_wakeup(struct Env *e);
+void sched_remove(struct Env *e);
+void sched_charge(struct Env *e);
+void sched_preempt(struct Env *e);
+
 #endif	// !JOS_KERN_SCHED_H
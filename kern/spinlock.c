@@ -16,6 +16,40 @@ struct spinlock kernel_lock = {
 #endif
 };
 
+#ifdef DEBUG_SPINLOCK
+struct spinlock *spinlocks = &kernel_lock;
+#endif
+
+#ifdef LOCKSTAT
+struct LockSite lockstat_sites[NCPU][LOCKSTAT_NSITES];
+uint32_t lockstat_dropped;
+
+// Find or add the entry for 'lk' acquired at 'site' in this CPU's
+// table.  Each CPU only touches its own table, so no lock is needed.
+// Returns NULL if the table is full.
+static struct LockSite *
+lockstat_lookup(struct spinlock *lk, uintptr_t site)
+{
+	struct LockSite *tab = lockstat_sites[thiscpu->cpu_id];
+	unsigned h = ((site >> 2) ^ ((uintptr_t) lk >> 4)) % LOCKSTAT_NSITES;
+	int i;
+
+	for (i = 0; i < LOCKSTAT_NSITES; i++, h = (h + 1) % LOCKSTAT_NSITES) {
+		if (tab[h].ls_site == site && tab[h].ls_lock == lk)
+			return &tab[h];
+		if (!tab[h].ls_site) {
+			// Start from zero even if a reset raced with a
+			// release that still added to this entry.
+			memset(&tab[h], 0, sizeof(tab[h]));
+			tab[h].ls_lock = lk;
+			tab[h].ls_site = site;
+			return &tab[h];
+		}
+	}
+	return NULL;
+}
+#endif
+
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
@@ -39,17 +73,21 @@ get_caller_pcs(uint32_t pcs[])
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lock->owner != lock->next && lock->cpu == thiscpu;
 }
 #endif
 
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
+	lk->next = lk->owner = 0;
 #ifdef DEBUG_SPINLOCK
 	lk->name = name;
 	lk->cpu = 0;
+	lk->nacquire = lk->ncontended = 0;
+	lk->spin_cycles = 0;
+	lk->link = spinlocks;
+	spinlocks = lk;
 #endif
 }
 
@@ -60,21 +98,60 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	spin_lock_at(lk, (uintptr_t) __builtin_return_address(0));
+}
+
+// Acquire the lock, charging it in lockstat to 'site': a return
+// address, or one of the LOCKSTAT_TRAP/LOCKSTAT_SYSCALL keys.
+void
+spin_lock_at(struct spinlock *lk, uintptr_t site)
+{
+	unsigned ticket;
+#ifdef DEBUG_SPINLOCK
+	uint64_t start = 0;
+#endif
+#ifdef LOCKSTAT
+	uint64_t now;
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-	// The xchg is atomic.
+	// The xadd is atomic.
 	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	// reordered before it.
+	ticket = xadd(&lk->next, 1);
+#ifdef DEBUG_SPINLOCK
+	// Time the wait, if there is one, for the statistics below.
+	if (lk->owner != ticket)
+		start = read_tsc();
+#endif
+	while (lk->owner != ticket)
+		asm volatile ("pause" ::: "memory");
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
 	lk->cpu = thiscpu;
 	get_caller_pcs(lk->pcs);
+	lk->nacquire++;
+	if (start) {
+		lk->ncontended++;
+		lk->spin_cycles += read_tsc() - start;
+	}
+#endif
+#ifdef LOCKSTAT
+	now = read_tsc();
+	lk->site = lockstat_lookup(lk, site);
+	if (lk->site) {
+		lk->site->ls_nacquire++;
+		if (start)
+			lk->site->ls_wait_cycles += now - start;
+	} else {
+		lockstat_dropped++;
+	}
+	lk->hold_start = now;
 #endif
 }
 
@@ -106,15 +183,19 @@ spin_unlock(struct spinlock *lk)
 	lk->pcs[0] = 0;
 	lk->cpu = 0;
 #endif
+#ifdef LOCKSTAT
+	if (lk->site)
+		lk->site->ls_hold_cycles += read_tsc() - lk->hold_start;
+#endif
 
-	// The xchg serializes, so that reads before release are 
+	// The xadd serializes, so that reads before release are
 	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
 	// 7.2) says reads can be carried out speculatively and in
 	// any order, which implies we need to serialize here.
 	// But the 2007 Intel 64 Architecture Memory Ordering White
 	// Paper says that Intel 64 and IA-32 will not move a load
-	// after a store. So lock->locked = 0 would work here.
-	// The xchg being asm volatile ensures gcc emits it after
+	// after a store. So lock->owner++ would work here.
+	// The xadd being asm volatile ensures gcc emits it after
 	// the above assignments (and after the critical section).
-	xchg(&lk->locked, 0);
+	xadd(&lk->owner, 1);
 }
@@ -6,9 +6,37 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
-// Mutual exclusion lock.
+// Uncomment this to time how long each call site waits for and holds
+// each lock (see the "lockstat" monitor command).  It costs a hash
+// lookup and two rdtsc per acquisition, so it is a profiling build.
+//#define LOCKSTAT
+
+#if defined(LOCKSTAT) && !defined(DEBUG_SPINLOCK)
+# error "LOCKSTAT needs DEBUG_SPINLOCK"
+#endif
+
+#define LOCKSTAT_NSITES	64	// Call sites tracked per CPU
+
+// Lockstat keys for kernel_lock taken on entry from user mode, which
+// tell the trap or system call apart where the return address would
+// not.  Return addresses are all above KERNBASE.
+#define LOCKSTAT_TRAP(trapno)		(0x1000 + (trapno))
+#define LOCKSTAT_SYSCALL(num)		(0x2000 + (num))
+
+// Time spent on one lock by one acquiring call site.
+struct LockSite {
+	struct spinlock *ls_lock;
+	uintptr_t ls_site;     // Return address of the spin_lock call
+	uint32_t ls_nacquire;
+	uint64_t ls_wait_cycles;
+	uint64_t ls_hold_cycles;
+};
+
+// Mutual exclusion lock.  CPUs take a ticket and are let in by
+// turn, so the lock is fair and waiters only read while they spin.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	volatile unsigned next;  // Next ticket to hand out
+	volatile unsigned owner; // Ticket now allowed in (== next: free)
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
@@ -16,15 +44,42 @@ struct spinlock {
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
+
+	// Statistics, updated by the holder
+	uint32_t nacquire;     // Times acquired
+	uint32_t ncontended;   // Times a CPU had to wait for it
+	uint64_t spin_cycles;  // Cycles spent waiting
+	struct spinlock *link; // Next lock in spinlocks
+#endif
+#ifdef LOCKSTAT
+	struct LockSite *site; // Where the holder acquired it (NULL: untracked)
+	uint64_t hold_start;   // TSC when it did
 #endif
 };
 
+#ifdef DEBUG_SPINLOCK
+// All locks, for the "spinlocks" monitor command
+extern struct spinlock *spinlocks;
+#endif
+#ifdef LOCKSTAT
+// Per-CPU tables of call sites, hashed by site and lock
+extern struct LockSite lockstat_sites[][LOCKSTAT_NSITES];
+extern uint32_t lockstat_dropped;      // Acquisitions with no free entry
+#endif
+
 void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
+void spin_lock_at(struct spinlock *lk, uintptr_t site);
 void spin_unlock(struct spinlock *lk);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
+// The big kernel lock still protects the Env table, every address
+// space, IPC state and the console input buffer; every trap from user
+// mode takes it, except the system calls syscall_lockfree() accepts.
+// Smaller locks nest inside it, in this order:
+//	kernel_lock, rq_lock (two in CPU order), pm_lock, page_lock
+// cons_lock and cpu_tlb_lock are leaves and may be taken under any.
 extern struct spinlock kernel_lock;
 
 static inline void
@@ -33,6 +88,14 @@ lock_kernel(void)
 	spin_lock(&kernel_lock);
 }
 
+// Take the kernel lock on behalf of a trap or system call (see
+// LOCKSTAT_TRAP), so that lockstat can tell the paths apart.
+static inline void
+lock_kernel_at(uintptr_t site)
+{
+	spin_lock_at(&kernel_lock, site);
+}
+
 static inline void
 unlock_kernel(void)
 {
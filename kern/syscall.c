@@ -89,7 +89,9 @@ sys_exofork(void)
         status = env_alloc(&newenv, sys_getenvid());
         if (status < 0) { return status; }
 
+        sched_remove(newenv);
         newenv->env_status = ENV_NOT_RUNNABLE;
+        newenv->env_priority = curenv->env_priority;
 
         //newenv->env_tf = curenv->env_tf;
         memmove(&(newenv->env_tf), &(curenv->env_tf), sizeof(struct Trapframe));
@@ -105,6 +107,109 @@ sys_exofork(void)
         return newenv->env_id;
 }
 
+// Give 'child' its own copy of the 4MB page at 'va' in the current
+// environment, or share it if it is PTE_SHARE (see duplargepage in
+// lib/fork.c).
+static int
+fork_large_page(struct Env *child, uintptr_t va)
+{
+	pde_t pde = curenv->env_pgdir[PDX(va)];
+	struct PageInfo *pp = pa2page(PTE_ADDR(pde)), *copy;
+
+	if (!(pde & PTE_SHARE)) {
+		if (!(copy = page_alloc_npages(PAGE_MAX_ORDER, 0)))
+			return -E_NO_MEM;
+		memmove(page2kva(copy), page2kva(pp), PTSIZE);
+		pp = copy;
+	}
+	page_insert_large(child->env_pgdir, pp, (void *) va, pde & PTE_SYSCALL);
+	return 0;
+}
+
+// Map the current environment's user pages into 'child' the way
+// lib/fork.c's fork does: PTE_SHARE and read-only pages as they are,
+// writable and copy-on-write pages copy-on-write in both, and a fresh
+// page for the exception stack.
+static int
+fork_copy_vm(struct Env *child)
+{
+	pde_t *pgdir = curenv->env_pgdir;
+	struct PageInfo *pp;
+	pte_t *pt;
+	uintptr_t va;
+	int pdeno, pteno, perm, r;
+
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (!(pgdir[pdeno] & PTE_P))
+			continue;
+		if (pgdir[pdeno] & PTE_PS) {
+			if ((r = fork_large_page(child, (uintptr_t) PGADDR(pdeno, 0, 0))) < 0)
+				return r;
+			continue;
+		}
+
+		pt = (pte_t *) KADDR(PTE_ADDR(pgdir[pdeno]));
+		for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+			if ((pt[pteno] & (PTE_P | PTE_U)) != (PTE_P | PTE_U))
+				continue;
+			va = (uintptr_t) PGADDR(pdeno, pteno, 0);
+
+			if (va == UXSTACKTOP - PGSIZE) {
+				if (!(pp = page_alloc(ALLOC_ZERO)))
+					return -E_NO_MEM;
+				if ((r = page_insert(child->env_pgdir, pp, (void *) va,
+						     PTE_P | PTE_U | PTE_W)) < 0) {
+					page_free(pp);
+					return r;
+				}
+				continue;
+			}
+
+			perm = pt[pteno] & PTE_SYSCALL;
+			if (!(perm & PTE_SHARE) && (perm & (PTE_W | PTE_COW))) {
+				perm = (perm & ~PTE_W) | PTE_COW;
+				if (pt[pteno] & PTE_W) {
+					pt[pteno] = (pt[pteno] & ~PTE_W) | PTE_COW;
+					tlb_invalidate(pgdir, (void *) va);
+				}
+			}
+			pp = pa2page(PTE_ADDR(pt[pteno]));
+			if ((r = page_insert(child->env_pgdir, pp, (void *) va, perm)) < 0)
+				return r;
+		}
+	}
+	return 0;
+}
+
+// Fork the current environment in one system call: create a child as
+// sys_exofork does, give it a copy-on-write copy of the caller's
+// address space and the caller's page fault upcall, and make it
+// runnable.  The child returns 0 from the call.  Copy-on-write faults
+// are resolved by the kernel (see page_cow_fault), so neither needs
+// an upcall.
+//
+// Returns the child's envid on success, < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static int
+sys_fork(void)
+{
+	struct Env *child;
+	int r;
+
+	if ((r = sys_exofork()) < 0)
+		return r;
+	child = &envs[ENVX(r)];
+	child->env_pgfault_upcall = curenv->env_pgfault_upcall;
+
+	if ((r = fork_copy_vm(child)) < 0) {
+		env_free(child);
+		return r;
+	}
+	sched_wakeup(child);
+	return child->env_id;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -112,6 +217,8 @@ sys_exofork(void)
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if status is not a valid status for an environment.
+//	-E_INVAL if status is ENV_RUNNABLE and envid is blocked sending
+//		or receiving an IPC; it would stay on the IPC queues.
 static int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -132,11 +239,51 @@ sys_env_set_status(envid_t envid, int status)
         check = envid2env(envid, &getenv, 1);
         if (check < 0) { return check; }
 
-        getenv->env_status = status;
+        if (status == ENV_RUNNABLE) {
+            if (getenv->env_status == ENV_NOT_RUNNABLE &&
+                (getenv->env_ipc_sendto || getenv->env_ipc_recving))
+                return -E_INVAL;
+            sched_wakeup(getenv);
+        }
+        else if (getenv->env_status != ENV_NOT_RUNNABLE) {
+            sched_remove(getenv);
+            getenv->env_status = status;
+        }
 
         return 0;
 }
 
+// Set envid's scheduling priority (nice value) to 'priority'.
+// Lower values get a larger share of the CPU and are run sooner after
+// waking up; see ENV_PRIO_* in inc/env.h.  Children created with
+// sys_exofork inherit their parent's priority.  Only the servers
+// (ENV_TYPE_FS, ENV_TYPE_NS) may raise a priority above both
+// ENV_PRIO_DEFAULT and their own, so that ordinary environments cannot
+// outrank them.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if priority is outside [ENV_PRIO_MIN, ENV_PRIO_MAX],
+//		or is below both ENV_PRIO_DEFAULT and the caller's own
+//		priority and the caller is not a server.
+static int
+sys_env_set_priority(envid_t envid, int priority)
+{
+	struct Env *e;
+	int r;
+
+	if (priority < ENV_PRIO_MIN || priority > ENV_PRIO_MAX)
+		return -E_INVAL;
+	if (curenv->env_type == ENV_TYPE_USER && priority < ENV_PRIO_DEFAULT
+	    && priority < curenv->env_priority)
+		return -E_INVAL;
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	e->env_priority = priority;
+	return 0;
+}
+
 // Set envid's trap frame to 'tf'.
 // tf is modified to make sure that user environments always run at code
 // protection level 3 (CPL 3) with interrupts enabled.
@@ -201,12 +348,16 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         As an exception, PTE_PS asks for a 4MB page instead, mapped
+//         at a 4MB-aligned 'va' in place of whatever was in that range.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
-//	-E_INVAL if va >= UTOP, or va is not page-aligned.
-//	-E_INVAL if perm is inappropriate (see above).
+//	-E_INVAL if va >= UTOP, or va is not page-aligned
+//		(4MB-aligned for PTE_PS).
+//	-E_INVAL if perm is inappropriate (see above), or has PTE_PS
+//		and the CPU does not support 4MB pages.
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
 static int
@@ -225,25 +376,37 @@ sys_page_alloc(envid_t envid, void *va, int perm)
         int check;
 
         // UTOP and va align check
-        if ( ((int) va >= UTOP) || (ROUNDUP(va, PGSIZE) != va) ) { 
+        if ( ((int) va >= UTOP) ||
+             (ROUNDUP(va, (perm & PTE_PS) ? PTSIZE : PGSIZE) != va) ) { 
             return -E_INVAL;
         }
         // permission check
         if ( !(perm & PTE_U) || !(perm & PTE_P) || 
-             (perm & ~PTE_SYSCALL) ) {
+             (perm & ~(PTE_SYSCALL | PTE_PS)) ) {
             return -E_INVAL;
         }
+        if ((perm & PTE_PS) && !page_pse) { return -E_INVAL; }
 
         // env check
         check = envid2env(envid, &getenv, 1);
         if (check < 0) { return check; }
 
+        if (perm & PTE_PS) {
+            newpage = page_alloc_npages(PAGE_MAX_ORDER, ALLOC_ZERO);
+            if (!newpage) { return -E_NO_MEM; }
+            page_insert_large(getenv->env_pgdir, newpage, va, perm);
+            return 0;
+        }
+
         // allocate page bug fixed ALLOC_ZERO = 0x10
         newpage = page_alloc(ALLOC_ZERO);
         if (!newpage) { return -E_NO_MEM; }
 
         check = page_insert(getenv->env_pgdir, newpage, va, perm);    
-        if (check < 0) { return check; }
+        if (check < 0) {
+            page_free(newpage);
+            return check;
+        }
 
         return 0;
 }
@@ -252,7 +415,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
 // that it also must not grant write access to a read-only
-// page.
+// page.  A 4MB page is mapped whole by passing PTE_PS, with srcva and
+// dstva 4MB-aligned; it cannot be mapped a page at a time.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
@@ -261,6 +425,7 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //		or dstva >= UTOP or dstva is not page-aligned.
 //	-E_INVAL is srcva is not mapped in srcenvid's address space.
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if (perm & PTE_PS) and the CPU does not support 4MB pages.
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
@@ -294,21 +459,34 @@ sys_page_map(envid_t srcenvid, void *srcva,
         }
 
         // check if srcva is correctly mapped in srcenvid's address space
-        srcpage = page_lookup(srcenv->env_pgdir, srcva, &src_store);
+        if (perm & PTE_PS) {
+            if (!page_pse || ((uintptr_t) srcva % PTSIZE) ||
+                ((uintptr_t) dstva % PTSIZE)) {
+                return -E_INVAL;
+            }
+            srcpage = page_lookup_large(srcenv->env_pgdir, srcva, &src_store);
+        } else {
+            srcpage = page_lookup(srcenv->env_pgdir, srcva, &src_store);
+        }
 
-        if (!srcpage) { panic("");
+        if (!srcpage) {
             return -E_INVAL;
         }
 
         // permission check
         if ( !(perm & PTE_U) || !(perm & PTE_P) ||
-             ((perm & ~PTE_SYSCALL) != 0)) {
+             ((perm & ~(PTE_SYSCALL | PTE_PS)) != 0)) {
             return -E_INVAL;
         }
         if ((perm & PTE_W) && !(*src_store & PTE_W)) {
             return -E_INVAL;
         }
 
+        if (perm & PTE_PS) {
+            page_insert_large(dstenv->env_pgdir, srcpage, dstva, perm);
+            return 0;
+        }
+
         // map pages: insert page to va 
         check = page_insert(dstenv->env_pgdir, srcpage, dstva, perm);
         if (check < 0) { 
@@ -320,11 +498,13 @@ sys_page_map(envid_t srcenvid, void *srcva,
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
 // If no page is mapped, the function silently succeeds.
+// A 4MB page is unmapped whole, given its 4MB-aligned start.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va is inside a 4MB page but not at its start.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -343,10 +523,416 @@ sys_page_unmap(envid_t envid, void *va)
         check = envid2env(envid, &getenv, 1);
         if (check < 0) { return check; }
 
+        if (page_lookup_large(getenv->env_pgdir, va, NULL)) {
+            if ((uintptr_t) va % PTSIZE) { return -E_INVAL; }
+            page_remove_large(getenv->env_pgdir, va);
+            return 0;
+        }
         page_remove(getenv->env_pgdir, va);
         return 0;
 }
 
+// Apply the 'n' page operations in 'ops' in order, as if each were its
+// own sys_page_alloc, sys_page_map or sys_page_unmap call, and store
+// each one's result in its po_result.  A failed entry does not stop
+// the ones after it.  The TLB invalidations for the whole batch are
+// sent to other CPUs together at the end.
+//
+// Returns the number of entries that failed, or < 0 on error.  Errors are:
+//	-E_INVAL if n is not in [0, PAGE_BATCH_MAX].
+//	-E_FAULT if the batch unmapped 'ops', so that results could
+//		not be stored.
+static int
+sys_page_batch(struct PageOp *ops, int n)
+{
+	struct PageOp batch[PAGE_BATCH_MAX], *op;
+	int nfailed = 0;
+
+	if (n < 0 || n > PAGE_BATCH_MAX)
+		return -E_INVAL;
+	user_mem_assert(curenv, ops, n * sizeof(*ops), PTE_U | PTE_W);
+	memmove(batch, ops, n * sizeof(*ops));
+
+	for (op = batch; op < batch + n; op++) {
+		switch (op->po_op) {
+		case PAGE_OP_ALLOC:
+			op->po_result = sys_page_alloc(op->po_dstenv, op->po_dstva,
+						       op->po_perm);
+			break;
+		case PAGE_OP_MAP:
+			op->po_result = sys_page_map(op->po_srcenv, op->po_srcva,
+						     op->po_dstenv, op->po_dstva,
+						     op->po_perm);
+			break;
+		case PAGE_OP_UNMAP:
+			op->po_result = sys_page_unmap(op->po_dstenv, op->po_dstva);
+			break;
+		default:
+			op->po_result = -E_INVAL;
+		}
+		if (op->po_result < 0)
+			nfailed++;
+	}
+	tlb_shootdown();
+
+	if (user_mem_check(curenv, ops, n * sizeof(*ops), PTE_U | PTE_W) < 0)
+		return -E_FAULT;
+	memmove(ops, batch, n * sizeof(*ops));
+	return nfailed;
+}
+
+// Look up the page 'src' wants to send at 'srcva' with permission
+// 'perm' and store it in *page_store.
+// Returns 0 on success, -E_INVAL if srcva is not page-aligned, perm is
+// inappropriate (see sys_page_alloc), srcva is not mapped, or perm
+// grants write access to a read-only page.
+static int
+ipc_lookup_page(struct Env *src, void *srcva, unsigned perm,
+		struct PageInfo **page_store)
+{
+	pte_t *pte;
+
+	if (PGOFF(srcva))
+		return -E_INVAL;
+	if (!(perm & PTE_U) || !(perm & PTE_P) || (perm & ~PTE_SYSCALL))
+		return -E_INVAL;
+	if (!(*page_store = page_lookup(src->env_pgdir, srcva, &pte)))
+		return -E_INVAL;
+	if ((perm & PTE_W) && !(*pte & PTE_W))
+		return -E_INVAL;
+	return 0;
+}
+
+// If 'perm' asks to send message words instead of a page (see
+// IPC_PERM_MSG), copy them from '*srcva' into curenv->env_ipc_sendmsg
+// and turn the arguments into a page-less send.  They stay there until
+// the message is delivered, even if we block.
+// Returns 0 on success, -E_INVAL if the words cannot be read.
+static int
+ipc_load_msg(void **srcva, unsigned *perm)
+{
+	unsigned n = IPC_MSG_LEN(*perm);
+
+	curenv->env_ipc_sendmsglen = 0;
+	if (!n)
+		return 0;
+	if (n > IPC_MSG_WORDS || (*perm & 0xFFF) || *srcva >= (void *) UTOP ||
+	    user_mem_check(curenv, *srcva, n * sizeof(uint32_t), PTE_U) < 0)
+		return -E_INVAL;
+	memmove(curenv->env_ipc_sendmsg, *srcva, n * sizeof(uint32_t));
+	curenv->env_ipc_sendmsglen = n;
+	*srcva = (void *) UTOP;
+	*perm = 0;
+	return 0;
+}
+
+static void ipc_unwait(struct Env *e);
+
+// Deliver 'value' (and the page at 'srcva' in src's address space, if
+// srcva < UTOP, and src's message words, if any) from 'src' to 'dst',
+// which must be waiting in sys_ipc_recv, and make 'dst' runnable with
+// sys_ipc_recv returning 0.
+// Nothing is delivered on error.
+// Returns 0 on success, < 0 on error (see sys_ipc_try_send).
+static int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value,
+	    void *srcva, unsigned perm)
+{
+	struct PageInfo *page;
+	int r, mapped = 0;
+
+	if (srcva < (void *) UTOP) {
+		if ((r = ipc_lookup_page(src, srcva, perm, &page)) < 0)
+			return r;
+		if (dst->env_ipc_dstva && dst->env_ipc_dstva < (void *) UTOP) {
+			if ((r = page_insert(dst->env_pgdir, page,
+					     dst->env_ipc_dstva, perm)) < 0)
+				return -E_NO_MEM;
+			mapped = 1;
+		}
+	}
+
+	dst->env_ipc_recving = 0;
+	ipc_unwait(dst);
+	dst->env_ipc_from = src->env_id;
+	dst->env_ipc_value = value;
+	dst->env_ipc_perm = mapped ? perm : 0;
+	dst->env_ipc_msglen = src->env_ipc_sendmsglen;
+	memmove(dst->env_ipc_msg, src->env_ipc_sendmsg,
+		src->env_ipc_sendmsglen * sizeof(uint32_t));
+	dst->env_tf.tf_regs.reg_eax = 0;
+	sched_wakeup(dst);
+	return 0;
+}
+
+// Direct handoff after a successful send to 'dst': the receiver was
+// blocked waiting for exactly this message, so give it the rest of our
+// timeslice on this CPU instead of waiting for the next sched_yield.
+// We go back on the run queue with the send already completed.
+static void
+ipc_handoff(struct Env *dst)
+{
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	env_run(dst);
+}
+
+// Which of e's sys_ipc_select sources does a message from 'src' come
+// from?  A NULL 'src' stands for e's message ring.  Returns the bit of
+// the first matching source, or 0 if there is none.
+static uint32_t
+ipc_select_bit(struct Env *e, struct Env *src)
+{
+	envid_t id;
+	int i;
+
+	for (i = 0; i < e->env_ipc_recvsetlen; i++) {
+		id = e->env_ipc_recvset[i];
+		if (src ? (id == 0 || id == src->env_id) : id == IPC_SRC_RING)
+			return 1 << i;
+	}
+	return 0;
+}
+
+// Would 'dst' accept a message from 'src' right now?  It must be
+// waiting in a receive, and if it is waiting for a reply from one
+// particular env, 'src' must be that env; if it is waiting in
+// sys_ipc_select, 'src' must be one of its sources.
+static bool
+ipc_accepts(struct Env *dst, struct Env *src)
+{
+	if (!dst->env_ipc_recving)
+		return 0;
+	if (dst->env_ipc_recvsetlen)
+		return ipc_select_bit(dst, src) != 0;
+	return !dst->env_ipc_recvfrom || dst->env_ipc_recvfrom == src->env_id;
+}
+
+// Queue curenv at the tail of dst's FIFO of blocked senders, with the
+// message it wants to send.  The caller then blocks.
+static void
+ipc_enqueue(struct Env *dst, uint32_t value, void *srcva, unsigned perm)
+{
+	curenv->env_ipc_sendto = dst;
+	curenv->env_ipc_sendval = value;
+	curenv->env_ipc_sendva = srcva;
+	curenv->env_ipc_sendperm = perm;
+	curenv->env_ipc_sendnext = NULL;
+	if (dst->env_ipc_senders_tail)
+		dst->env_ipc_senders_tail->env_ipc_sendnext = curenv;
+	else
+		dst->env_ipc_senders = curenv;
+	dst->env_ipc_senders_tail = curenv;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+}
+
+// Unlink and return the first env blocked sending to 'e' whose message
+// 'e' accepts, or NULL if there is none.
+static struct Env *
+ipc_dequeue(struct Env *e)
+{
+	struct Env *s, *prev = NULL;
+
+	for (s = e->env_ipc_senders; s && !ipc_accepts(e, s); s = s->env_ipc_sendnext)
+		prev = s;
+	if (!s)
+		return NULL;
+	if (prev)
+		prev->env_ipc_sendnext = s->env_ipc_sendnext;
+	else
+		e->env_ipc_senders = s->env_ipc_sendnext;
+	if (e->env_ipc_senders_tail == s)
+		e->env_ipc_senders_tail = prev;
+	s->env_ipc_sendto = NULL;
+	return s;
+}
+
+// Record that 'e', now blocked receiving, waits only for the env
+// 'from', so that freeing 'from' can fail the receive (see ipc_cancel).
+static void
+ipc_waitfor(struct Env *e, envid_t from)
+{
+	struct Env *w = &envs[ENVX(from)];
+
+	if (!from || w->env_id != from || w->env_status == ENV_FREE)
+		return;
+	e->env_ipc_waitfor = w;
+	e->env_ipc_waitnext = w->env_ipc_waiters;
+	w->env_ipc_waiters = e;
+}
+
+// Undo ipc_waitfor, if 'e' is on a list of waiters.
+static void
+ipc_unwait(struct Env *e)
+{
+	struct Env **pw;
+
+	if (!e->env_ipc_waitfor)
+		return;
+	for (pw = &e->env_ipc_waitfor->env_ipc_waiters; *pw != e;
+	     pw = &(*pw)->env_ipc_waitnext)
+		;
+	*pw = e->env_ipc_waitnext;
+	e->env_ipc_waitfor = NULL;
+}
+
+// Does 'e' have entries in its message ring that it has not taken yet?
+static bool
+ipc_ring_pending(struct Env *e)
+{
+	return e->env_ipc_ring &&
+		e->env_ipc_ring->ir_head != e->env_ipc_ring->ir_tail;
+}
+
+// Append curenv's message to dst's message ring without waiting for
+// dst: 'value', and the page at 'srcva' if srcva < UTOP, which is
+// mapped at the ring slot's VA in dst (if dst accepts pages).
+// Returns 0 on success, -E_IPC_NOT_RECV if dst has no ring or it is
+// full, or an error of ipc_lookup_page or -E_NO_MEM.
+static int
+ipc_ring_put(struct Env *dst, uint32_t value, void *srcva, unsigned perm)
+{
+	struct IpcRing *ring = dst->env_ipc_ring;
+	struct IpcRingEntry *ent;
+	struct PageInfo *page;
+	uint32_t slot, bit;
+	void *va = NULL;
+	int r;
+
+	if (!ring || ring->ir_head - ring->ir_tail >= IPC_RING_SIZE)
+		return -E_IPC_NOT_RECV;
+	slot = ring->ir_head % IPC_RING_SIZE;
+
+	if (srcva < (void *) UTOP) {
+		if ((r = ipc_lookup_page(curenv, srcva, perm, &page)) < 0)
+			return r;
+		if (dst->env_ipc_ringva < (void *) UTOP) {
+			va = dst->env_ipc_ringva + slot * PGSIZE;
+			if (page_insert(dst->env_pgdir, page, va, perm) < 0)
+				return -E_NO_MEM;
+		}
+	}
+
+	ent = &ring->ir_ent[slot];
+	ent->ire_from = curenv->env_id;
+	ent->ire_value = value;
+	ent->ire_perm = va ? perm : 0;
+	ent->ire_va = va;
+	ent->ire_msglen = curenv->env_ipc_sendmsglen;
+	memmove(ent->ire_msg, curenv->env_ipc_sendmsg,
+		curenv->env_ipc_sendmsglen * sizeof(uint32_t));
+	ring->ir_head++;
+
+	// Wake dst if it is selecting on its ring.
+	if (dst->env_ipc_recving && (bit = ipc_select_bit(dst, NULL))) {
+		dst->env_ipc_recving = 0;
+		dst->env_ipc_from = 0;
+		dst->env_tf.tf_regs.reg_eax = bit;
+		sched_wakeup(dst);
+	}
+	return 0;
+}
+
+// Make 'e' wait for a message from 'from' (0 means any env), to be
+// mapped at 'dstva'.  If an acceptable sender is already blocked on
+// 'e', its message is delivered at once and the sender is woken; a
+// sender that made an sys_ipc_call (or whose reply was queued by
+// sys_ipc_reply_wait) goes on to wait for its own next message.
+//
+// Returns 0 if 'e' received a message, or 1 if 'e' is now blocked
+// ENV_NOT_RUNNABLE waiting for one.
+static int
+ipc_wait(struct Env *e, void *dstva, envid_t from)
+{
+	struct Env *s;
+	int r, first = 1;
+
+	while (1) {
+		e->env_ipc_recving = 1;
+		e->env_ipc_dstva = dstva;
+		e->env_ipc_recvfrom = from;
+		e->env_ipc_recvsetlen = 0;
+		e->env_ipc_from = 0;
+
+		if (!(s = ipc_dequeue(e))) {
+			e->env_status = ENV_NOT_RUNNABLE;
+			ipc_waitfor(e, from);
+			return first;
+		}
+
+		// A sender whose page can no longer be delivered gets the
+		// error and we move on to the next.
+		r = ipc_deliver(s, e, s->env_ipc_sendval,
+				s->env_ipc_sendva, s->env_ipc_sendperm);
+		if (r < 0 || !s->env_ipc_calling) {
+			s->env_ipc_calling = 0;
+			s->env_tf.tf_regs.reg_eax = r;
+			sched_wakeup(s);
+			if (r < 0)
+				continue;
+			return 0;
+		}
+
+		// Now the sender waits, with the receive arguments it
+		// saved when it was queued.  A server with entries in its
+		// message ring returns 1 to take them first.
+		s->env_ipc_calling = 0;
+		if (!s->env_ipc_recvfrom && ipc_ring_pending(s)) {
+			s->env_tf.tf_regs.reg_eax = 1;
+			sched_wakeup(s);
+			return 0;
+		}
+		e = s;
+		dstva = s->env_ipc_dstva;
+		from = s->env_ipc_recvfrom;
+		first = 0;
+	}
+}
+
+// Fail every send blocked on 'e' and every call waiting for a reply
+// from 'e' with -E_BAD_ENV, withdraw the send 'e' itself is blocked
+// in, if any, and drop its message ring.  Called when 'e' is freed.
+void
+ipc_cancel(struct Env *e)
+{
+	struct Env *s, *w, *prev = NULL;
+
+	if ((s = e->env_ipc_sendto)) {
+		for (w = s->env_ipc_senders; w != e; w = w->env_ipc_sendnext)
+			prev = w;
+		if (prev)
+			prev->env_ipc_sendnext = e->env_ipc_sendnext;
+		else
+			s->env_ipc_senders = e->env_ipc_sendnext;
+		if (s->env_ipc_senders_tail == e)
+			s->env_ipc_senders_tail = prev;
+		e->env_ipc_sendto = NULL;
+	}
+
+	while ((s = e->env_ipc_senders)) {
+		e->env_ipc_senders = s->env_ipc_sendnext;
+		s->env_ipc_sendto = NULL;
+		s->env_ipc_calling = 0;
+		s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		sched_wakeup(s);
+	}
+	e->env_ipc_senders_tail = NULL;
+
+	if (e->env_ipc_ring) {
+		page_decref(pa2page(PADDR(e->env_ipc_ring)));
+		e->env_ipc_ring = NULL;
+	}
+
+	// Envs in sys_ipc_call waiting for e's reply will never get it.
+	ipc_unwait(e);
+	while ((w = e->env_ipc_waiters)) {
+		e->env_ipc_waiters = w->env_ipc_waitnext;
+		w->env_ipc_waitfor = NULL;
+		w->env_ipc_recving = 0;
+		w->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		sched_wakeup(w);
+	}
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -361,10 +947,18 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise;
+//    env_ipc_msg and env_ipc_msglen get the message words, if any
+//    (perm == IPC_PERM_MSG(n): n words at 'srcva' are sent, no page).
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
-// sys_ipc_recv function ever actually return?)
+// sys_ipc_recv function ever actually return?)  On success the
+// target runs immediately on this CPU and the sender is re-queued,
+// so this call does not return; the sender sees 0 when it next runs.
+//
+// If the target is not waiting but has a message ring (see sys_ipc_ring)
+// with room, the message is appended to the ring instead and the call
+// returns 0 at once.
 //
 // If the sender wants to send a page but the receiver isn't asking for one,
 // then no page mapping is transferred, but no error occurs.
@@ -375,7 +969,9 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_BAD_ENV if environment envid doesn't currently exist.
 //		(No need to check permissions.)
 //	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
+//		or another environment managed to send first, or envid
+//		is in sys_ipc_call waiting for a reply from someone else,
+//		and envid has no message ring or it is full.
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
@@ -383,6 +979,8 @@ sys_page_unmap(envid_t envid, void *va)
 //		address space.
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space. (and srcva < UTOP)
+//	-E_INVAL if perm is IPC_PERM_MSG(n) but n > IPC_MSG_WORDS or
+//		the n words at srcva are not readable.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
 static int
@@ -391,43 +989,64 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	// LAB 4: Your code here.
         int r;
         struct Env *dstenv;
-        struct PageInfo *page;
-        pte_t *pte_store;
 
         if ((r = envid2env(envid, &dstenv, 0)) < 0) {
             return -E_BAD_ENV;
         }
-        if (!(dstenv->env_ipc_recving)) {
-            return -E_IPC_NOT_RECV;
+        if ((r = ipc_load_msg(&srcva, &perm)) < 0) {
+            return r;
         }
-        if (srcva < (void *)UTOP) {
-           if (ROUNDUP(srcva, PGSIZE) != srcva) { return -E_INVAL; }
-           if ( !(perm & PTE_U) || !(perm & PTE_P) || (perm & ~PTE_SYSCALL) ) {
-               return -E_INVAL;
-           }
-           if (!(page = page_lookup(curenv->env_pgdir, srcva, &pte_store))) {
-               return -E_INVAL;
-           }
-           if ((perm & PTE_W) && !((*pte_store) & PTE_W)) { return -E_INVAL; }
+        if (!ipc_accepts(dstenv, curenv)) {
+            return ipc_ring_put(dstenv, value, srcva, perm);
         }
-           
-        dstenv->env_ipc_value = value;
-        dstenv->env_ipc_from = sys_getenvid();
-        dstenv->env_status = ENV_RUNNABLE;
-        dstenv->env_ipc_recving = 0;
-        dstenv->env_tf.tf_regs.reg_eax = 0;
-
-        if ((srcva < (void *)UTOP) && dstenv->env_ipc_dstva && (dstenv->env_ipc_dstva < (void *) UTOP)) {
-            // we can not use sys_page_alloc since the sent page is already allocated
-            if ((r = page_insert(dstenv->env_pgdir, page, dstenv->env_ipc_dstva, perm)) < 0) {
-                return -E_NO_MEM;
-            }
-            dstenv->env_ipc_perm = perm;
+        if ((r = ipc_deliver(curenv, dstenv, value, srcva, perm)) < 0) {
+            return r;
         }
 
+        ipc_handoff(dstenv);
         return 0;
 }
 
+// Send 'value' (and the page at 'srcva', as for sys_ipc_try_send) to
+// 'envid', blocking until it is received.  If the target is not
+// waiting in sys_ipc_recv, the caller is queued on the target and
+// marked ENV_NOT_RUNNABLE; blocked senders are served in FIFO order
+// by the target's subsequent sys_ipc_recv calls.
+//
+// Returns 0 once the message has been received, < 0 on error.
+// Errors are those of sys_ipc_try_send except -E_IPC_NOT_RECV, and:
+//	-E_INVAL if envid is the caller itself.
+//	-E_BAD_ENV if the target exits while we are blocked.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *dstenv;
+	struct PageInfo *page;
+	int r;
+
+	if ((r = envid2env(envid, &dstenv, 0)) < 0)
+		return -E_BAD_ENV;
+	if (dstenv == curenv)
+		return -E_INVAL;
+	if ((r = ipc_load_msg(&srcva, &perm)) < 0)
+		return r;
+	if (ipc_accepts(dstenv, curenv)) {
+		if ((r = ipc_deliver(curenv, dstenv, value, srcva, perm)) < 0)
+			return r;
+		ipc_handoff(dstenv);
+	}
+
+	// Check the page now so that bad arguments fail right away
+	// rather than when the receiver gets around to us.
+	if (srcva < (void *) UTOP &&
+	    (r = ipc_lookup_page(curenv, srcva, perm, &page)) < 0)
+		return r;
+
+	// The receiver sets our return value when it takes the message.
+	ipc_enqueue(dstenv, value, srcva, perm);
+	sched_yield();
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
@@ -435,6 +1054,12 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// If envs are blocked in sys_ipc_send to us, the first one's message is
+// received right away and the sender is woken up instead.
+//
+// If our message ring has entries we have not taken, returns 1 at once
+// without receiving anything, so the ring is drained first.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
@@ -448,10 +1073,12 @@ sys_ipc_recv(void *dstva)
             return -E_INVAL;
         }
 
-        curenv->env_ipc_recving = 1;
-        curenv->env_ipc_dstva = dstva;
-        curenv->env_ipc_from = 0;
-        curenv->env_status = ENV_NOT_RUNNABLE;
+        if (ipc_ring_pending(curenv)) {
+            return 1;
+        }
+        if (ipc_wait(curenv, dstva, 0) == 0) {
+            return 0;
+        }
 
         // mistake: no need to loop here  
         sched_yield();
@@ -460,6 +1087,211 @@ sys_ipc_recv(void *dstva)
 	return 0;
 }
 
+// Send a request to 'envid' and wait for the reply from that same env,
+// in one system call.  'value', 'srcva' and 'perm' are the request, as
+// for sys_ipc_send (including blocking until 'envid' takes it); 'dstva'
+// is where a page sent with the reply is mapped, as for sys_ipc_recv.
+// While waiting for the reply, messages from other envs are held off.
+//
+// Returns 0 once the reply has arrived in thisenv->env_ipc_*, < 0 on
+// error.  Errors are those of sys_ipc_send and sys_ipc_recv, and
+// -E_BAD_ENV if 'envid' exits before replying.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+	struct Env *dstenv;
+	struct PageInfo *page;
+	int r;
+
+	if (dstva && dstva < (void *) UTOP && PGOFF(dstva))
+		return -E_INVAL;
+	if ((r = envid2env(envid, &dstenv, 0)) < 0)
+		return -E_BAD_ENV;
+	if (dstenv == curenv)
+		return -E_INVAL;
+	if ((r = ipc_load_msg(&srcva, &perm)) < 0)
+		return r;
+
+	if (ipc_accepts(dstenv, curenv)) {
+		if ((r = ipc_deliver(curenv, dstenv, value, srcva, perm)) < 0)
+			return r;
+		if (ipc_wait(curenv, dstva, dstenv->env_id) == 0)
+			return 0;
+		// Run the server right away; we are blocked, so env_run
+		// does not put us back on the run queue.
+		env_run(dstenv);
+	}
+
+	if (srcva < (void *) UTOP &&
+	    (r = ipc_lookup_page(curenv, srcva, perm, &page)) < 0)
+		return r;
+
+	// Remember how to wait for the reply once the server takes the
+	// request (see ipc_wait).
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_recvfrom = dstenv->env_id;
+	curenv->env_ipc_calling = 1;
+	ipc_enqueue(dstenv, value, srcva, perm);
+	sched_yield();
+}
+
+// Reply to 'envid' and wait for the next message from any env, in one
+// system call.  This is the server side of sys_ipc_call.  'value',
+// 'srcva' and 'perm' are the reply; 'dstva' is where a page sent with
+// the next request is mapped.  If 'envid' is 0, or no longer exists,
+// no reply is sent.  If 'envid' is not yet waiting for the reply (it
+// sent its request with a separate send and receive), the reply is
+// queued as by sys_ipc_send and we wait once it is taken.
+//
+// Returns 0 once the next message has arrived in thisenv->env_ipc_*,
+// 1 if our message ring has entries instead (as for sys_ipc_recv),
+// < 0 on error.  Errors are those of sys_ipc_send and sys_ipc_recv.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		   void *dstva)
+{
+	struct Env *client = NULL;
+	struct PageInfo *page;
+	int r;
+
+	if (dstva && dstva < (void *) UTOP && PGOFF(dstva))
+		return -E_INVAL;
+	if (envid && envid2env(envid, &client, 0) < 0)
+		client = NULL;
+	if (client == curenv)
+		return -E_INVAL;
+	if ((r = ipc_load_msg(&srcva, &perm)) < 0)
+		return r;
+
+	if (client && ipc_accepts(client, curenv)) {
+		if ((r = ipc_deliver(curenv, client, value, srcva, perm)) < 0)
+			return r;
+	} else if (client) {
+		if (srcva < (void *) UTOP &&
+		    (r = ipc_lookup_page(curenv, srcva, perm, &page)) < 0)
+			return r;
+		curenv->env_ipc_dstva = dstva;
+		curenv->env_ipc_recvfrom = 0;
+		curenv->env_ipc_calling = 1;
+		ipc_enqueue(client, value, srcva, perm);
+		sched_yield();
+	}
+
+	if (ipc_ring_pending(curenv))
+		return 1;
+	if (ipc_wait(curenv, dstva, 0) == 0)
+		return 0;
+	// Nothing else to serve: let the client we just answered run.
+	if (client)
+		env_run(client);
+	sched_yield();
+}
+
+// Set up the page at 'ringva' in the caller's address space as its
+// message ring (a struct IpcRing, emptied here), so that
+// sys_ipc_try_send to the caller no longer needs it to be waiting.
+// Pages sent through the ring are mapped at 'pgva' + slot * PGSIZE,
+// an area of IPC_RING_SIZE pages; if 'pgva' >= UTOP, pages are not
+// accepted.  If 'ringva' >= UTOP, the caller's ring is removed.
+// The caller should not unmap or reuse the ring page while it is set.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if ringva < UTOP but is not page-aligned or not mapped
+//		writable in the caller's address space.
+//	-E_INVAL if pgva < UTOP but is not page-aligned or the area
+//		extends past UTOP.
+static int
+sys_ipc_ring(void *ringva, void *pgva)
+{
+	struct PageInfo *pp = NULL;
+	pte_t *pte;
+
+	static_assert(sizeof(struct IpcRing) <= PGSIZE);
+
+	if (ringva < (void *) UTOP) {
+		if (PGOFF(ringva))
+			return -E_INVAL;
+		if (!(pp = page_lookup(curenv->env_pgdir, ringva, &pte)) ||
+		    !(*pte & PTE_W) || !(*pte & PTE_U))
+			return -E_INVAL;
+		if (pgva < (void *) UTOP &&
+		    (PGOFF(pgva) ||
+		     (uintptr_t) pgva + IPC_RING_SIZE * PGSIZE > UTOP))
+			return -E_INVAL;
+		pp->pp_ref++;
+	}
+
+	if (curenv->env_ipc_ring)
+		page_decref(pa2page(PADDR(curenv->env_ipc_ring)));
+	curenv->env_ipc_ring = NULL;
+	if (pp) {
+		curenv->env_ipc_ring = page2kva(pp);
+		curenv->env_ipc_ring->ir_head = curenv->env_ipc_ring->ir_tail = 0;
+		curenv->env_ipc_ringva = pgva;
+	}
+	return 0;
+}
+
+// Wait for a message from any of the 'n' sources in 'srcs', given in
+// priority order: an envid, 0 for any env, or IPC_SRC_RING for our
+// message ring.  If some sources already have messages waiting (envs
+// blocked in sys_ipc_send or sys_ipc_call to us, or ring entries),
+// the message from the first of them is received as by sys_ipc_recv,
+// and the bits (1 << i) of all ready sources are returned.  If the
+// first ready source is our ring, nothing is received: drain the
+// ring.  Otherwise we block until one of the sources sends; then the
+// call returns 0 with the message received (thisenv->env_ipc_from
+// tells which source), or the bit of IPC_SRC_RING if the ring
+// got an entry.
+//
+// Returns the ready mask, 0 or a ring bit as described, or < 0 on
+// error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if n is not between 1 and IPC_SELECT_MAX, or 'srcs'
+//		is not readable.
+static int
+sys_ipc_select(const envid_t *srcs, int n, void *dstva)
+{
+	struct Env *s;
+	uint32_t ready = 0;
+	int i;
+
+	if (dstva && dstva < (void *) UTOP && PGOFF(dstva))
+		return -E_INVAL;
+	if (n < 1 || n > IPC_SELECT_MAX ||
+	    user_mem_check(curenv, srcs, n * sizeof(envid_t), PTE_U) < 0)
+		return -E_INVAL;
+	memmove(curenv->env_ipc_recvset, srcs, n * sizeof(envid_t));
+	curenv->env_ipc_recvsetlen = n;
+
+	if (ipc_ring_pending(curenv))
+		ready |= ipc_select_bit(curenv, NULL);
+	for (s = curenv->env_ipc_senders; s; s = s->env_ipc_sendnext)
+		ready |= ipc_select_bit(curenv, s);
+
+	if (ready) {
+		for (i = 0; !(ready & (1 << i)); i++)
+			;
+		if (curenv->env_ipc_recvset[i] == IPC_SRC_RING) {
+			curenv->env_ipc_recvsetlen = 0;
+			return ready;
+		}
+		if (ipc_wait(curenv, dstva, curenv->env_ipc_recvset[i]) == 0)
+			return ready;
+		// The sender's page could not be delivered after all.
+		ipc_unwait(curenv);
+		curenv->env_ipc_recvsetlen = n;
+	}
+
+	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_recvfrom = 0;
+	curenv->env_ipc_from = 0;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_yield();
+}
+
 // Return the current time.
 static int
 sys_time_msec(void)
@@ -468,6 +1300,16 @@ sys_time_msec(void)
         return time_msec();
 }
 
+// Store the time since boot, in nanoseconds, in *nsec.
+// Destroys the environment if nsec is not writable.
+static int
+sys_time_nsec(uint64_t *nsec)
+{
+	user_mem_assert(curenv, nsec, sizeof(*nsec), PTE_U | PTE_W);
+	*nsec = time_nsec();
+	return 0;
+}
+
 static int
 sys_net_try_send(char *data, int len) {
     if ((uintptr_t) data >= UTOP) {
@@ -488,6 +1330,26 @@ sys_net_try_recv(char *data, int *len) {
     return *len;
 }
 
+// Returns true if system call 'syscallno', with first argument 'a1',
+// may run without the big kernel lock.  Such calls only read state that
+// belongs to the calling environment or that is published under a
+// seqcount, and write only the caller's own memory.  A sys_time_nsec
+// with a bad pointer takes the lock, since it destroys the caller.
+bool
+syscall_lockfree(uint32_t syscallno, uint32_t a1)
+{
+	switch (syscallno) {
+	case SYS_getenvid:
+	case SYS_time_msec:
+		return 1;
+	case SYS_time_nsec:
+		return user_mem_check(curenv, (void *) a1, sizeof(uint64_t),
+				      PTE_U | PTE_W) == 0;
+	default:
+		return 0;
+	}
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -525,14 +1387,32 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
                 return sys_ipc_try_send((envid_t) a1, (uint32_t) a2, (void *)a3, (unsigned)a4);
             case SYS_ipc_recv:
                 return sys_ipc_recv((void *)a1);
+            case SYS_ipc_send:
+                return sys_ipc_send((envid_t) a1, (uint32_t) a2, (void *)a3, (unsigned)a4);
+            case SYS_ipc_call:
+                return sys_ipc_call((envid_t) a1, (uint32_t) a2, (void *)a3, (unsigned)a4, (void *)a5);
+            case SYS_ipc_reply_wait:
+                return sys_ipc_reply_wait((envid_t) a1, (uint32_t) a2, (void *)a3, (unsigned)a4, (void *)a5);
             case SYS_env_set_trapframe:
                 return sys_env_set_trapframe((envid_t) a1, (struct Trapframe *) a2);
             case SYS_time_msec:
                 return sys_time_msec();
+            case SYS_time_nsec:
+                return sys_time_nsec((uint64_t *) a1);
             case SYS_net_try_send:
                 return sys_net_try_send((char *) a1, (int) a2);
             case SYS_net_try_recv:
                 return sys_net_try_recv((char *) a1, (int *) a2);
+            case SYS_env_set_priority:
+                return sys_env_set_priority((envid_t) a1, (int) a2);
+            case SYS_ipc_ring:
+                return sys_ipc_ring((void *) a1, (void *) a2);
+            case SYS_ipc_select:
+                return sys_ipc_select((const envid_t *) a1, (int) a2, (void *) a3);
+            case SYS_fork:
+                return sys_fork();
+            case SYS_page_batch:
+                return sys_page_batch((struct PageOp *) a1, (int) a2);
             case NSYSCALLS:
 	    default:
                 return -E_INVAL;
@@ -6,6 +6,10 @@
 
 #include <inc/syscall.h>
 
+struct Env;
+
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+bool	syscall_lockfree(uint32_t num, uint32_t a1);
+void	ipc_cancel(struct Env *e);
 
 #endif /* !JOS_KERN_SYSCALL_H */
@@ -1,26 +1,83 @@
 #include <kern/time.h>
+#include <kern/kclock.h>
 #include <inc/assert.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
 
-static unsigned int ticks;
+// The clock is the TSC scaled to nanoseconds.  The timekeeping CPU
+// moves its base forward on every timer tick (see time_tick), and
+// readers on any CPU add the cycles since then.  tk_seq is odd while
+// the base is being changed.
+static volatile uint32_t tk_seq;
+static uint64_t tk_tsc;		// TSC at the last tick
+static uint64_t tk_nsec;	// Nanoseconds since boot at the last tick
+static uint64_t tk_mult;	// Nanoseconds per cycle, 32.32 fixed point
+
+// Scale a cycle count to nanoseconds without overflowing 64 bits.
+static uint64_t
+cycles2ns(uint64_t cycles)
+{
+	uint32_t lo = cycles, hi = cycles >> 32;
+	uint32_t mlo = tk_mult, mhi = tk_mult >> 32;
+
+	return hi * tk_mult + (uint64_t) lo * mhi
+		+ (((uint64_t) lo * mlo) >> 32);
+}
 
 void
 time_init(void)
 {
-	ticks = 0;
+	uint64_t hz = pit_tsc_hz();
+
+	if (!hz) {
+		cprintf("time: PIT did not respond, assuming a 1 GHz TSC\n");
+		hz = 1000000000;
+	}
+	tk_mult = (1000000000ULL << 32) / hz;
+	tk_tsc = read_tsc();
+	tk_nsec = 0;
+	cprintf("time: TSC runs at %u kHz\n", (uint32_t) (hz / 1000));
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
+// This should be called once per timer interrupt, on one CPU only.
+// A timer interrupt fires every 10 ms, so readers never scale more
+// than a few milliseconds of cycles.
 void
 time_tick(void)
 {
-	ticks++;
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	uint64_t now = read_tsc();
+	uint64_t nsec = tk_nsec + cycles2ns(now - tk_tsc);
+
+	tk_seq++;
+	asm volatile("" ::: "memory");
+	tk_tsc = now;
+	tk_nsec = nsec;
+	asm volatile("" ::: "memory");
+	tk_seq++;
+}
+
+// Nanoseconds since boot.
+uint64_t
+time_nsec(void)
+{
+	uint32_t seq;
+	uint64_t tsc, nsec, now;
+
+	do {
+		seq = tk_seq;
+		asm volatile("" ::: "memory");
+		tsc = tk_tsc;
+		nsec = tk_nsec;
+		asm volatile("" ::: "memory");
+	} while ((seq & 1) || seq != tk_seq);
+
+	// This CPU's TSC may run slightly behind the timekeeper's.
+	now = read_tsc();
+	return now > tsc ? nsec + cycles2ns(now - tsc) : nsec;
 }
 
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return time_nsec() / 1000000;
 }
@@ -110,6 +110,7 @@ trap_init(void)
         extern void ENTRY_IRQ13();
         extern void ENTRY_IRQ14();
         extern void ENTRY_IRQ15();
+        extern void ENTRY_TLBFLUSH();
 
 // ZY: Segment selector of GDT and IDT:
 // A reference to a desriptor you can load into a segment register;
@@ -155,6 +156,7 @@ trap_init(void)
     SETGATE(idt[13+IRQ_OFFSET], 0, GD_KT, ENTRY_IRQ13, 0);
     SETGATE(idt[14+IRQ_OFFSET], 0, GD_KT, ENTRY_IRQ14, 0);
     SETGATE(idt[15+IRQ_OFFSET], 0, GD_KT, ENTRY_IRQ15, 0);
+    SETGATE(idt[IRQ_TLBFLUSH+IRQ_OFFSET], 0, GD_KT, ENTRY_TLBFLUSH, 0);
 
 	// Per-CPU setup 
 	trap_init_percpu();
@@ -176,7 +178,7 @@ trap_init_percpu(void)
 	//     thiscpu->cpu_id;
 	//   - Use "thiscpu->cpu_ts" as the TSS for the current CPU,
 	//     rather than the global "ts" variable;
-	//   - Use gdt[(GD_TSS0 >> 3) + i] for CPU i's TSS descriptor;
+	//   - Use gdt[(GD_TSS0 >> 3) + 2 * i] for CPU i's TSS descriptor;
 	//   - You mapped the per-CPU kernel stacks in mem_init_mp()
 	//
 	// ltr sets a 'busy' flag in the TSS selector, so if you
@@ -197,13 +199,13 @@ trap_init_percpu(void)
 
         // Initialize the TSS slot of the gdt.
 
-        gdt[(GD_TSS0 >> 3) + id] = SEG16(STS_T32A, (uint32_t) &(thiscpu->cpu_ts),
-                                        sizeof(struct Taskstate), 0);
-        gdt[(GD_TSS0 >> 3) + id].sd_s = 0;
+        gdt[(GD_TSS0 >> 3) + 2 * id] = SEG16(STS_T32A, (uint32_t) &(thiscpu->cpu_ts),
+                                             sizeof(struct Taskstate), 0);
+        gdt[(GD_TSS0 >> 3) + 2 * id].sd_s = 0;
 
         // Load the TSS selector (like other segment selectors, the
         // bottom three bits are special; we leave them 0)
-        ltr((GD_TSS0 + (id << 3)) & ~0x7);
+        ltr((GD_TSS0 + (id << 4)) & ~0x7);
 
         // Load the IDT
         lidt(&idt_pd);
@@ -301,9 +303,11 @@ trap_dispatch(struct Trapframe *tf)
 	// triggered on every CPU.
 	// LAB 6: Your code here.
         if (tf->tf_trapno == IRQ_TIMER+IRQ_OFFSET) {
-            time_tick();
+            // The boot CPU keeps time for everyone.
+            if (thiscpu == bootcpu)
+                time_tick();
             lapic_eoi();
-            sched_yield();
+            sched_tick();
             return;
         }
         
@@ -342,29 +346,67 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
+	// TLB shootdowns are handled without the big kernel lock: the
+	// CPU that sent one holds it while it waits for us.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLBFLUSH) {
+		tlb_shootdown_recv();
+		lapic_eoi();
+		env_pop_tf(tf);
+	}
 
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// Re-acqurie the big kernel lock if we were halted in
+	// sched_yield(), unless this is a clock tick with nothing to
+	// run: then keep time and go back to sleep without it.
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED) {
+		if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER
+		    && !sched_runnable()) {
+			if (thiscpu == bootcpu)
+				time_tick();
+			lapic_eoi();
+			sched_idle();
+		}
+		lock_kernel_at(LOCKSTAT_TRAP(tf->tf_trapno));
+	}
 
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
 	assert(!(read_eflags() & FL_IF));
 
+	// System calls that need no lock return straight to the caller.
+	// We stay marked as in user mode, so a CPU shooting down our TLB
+	// waits for us to pick up its batch here.
+	if ((tf->tf_cs & 3) == 3 && tf->tf_trapno == T_SYSCALL
+	    && curenv->env_status == ENV_RUNNING
+	    && syscall_lockfree(tf->tf_regs.reg_eax, tf->tf_regs.reg_edx)) {
+		tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax,
+					      tf->tf_regs.reg_edx,
+					      tf->tf_regs.reg_ecx,
+					      tf->tf_regs.reg_ebx,
+					      tf->tf_regs.reg_edi,
+					      tf->tf_regs.reg_esi);
+		tlb_shootdown_recv();
+		env_pop_tf(tf);
+	}
+
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
 		// Acquire the big kernel lock before doing any
 		// serious kernel work.
 		// LAB 4: Your code here.
 		assert(curenv);
-                lock_kernel();
+                xchg(&thiscpu->cpu_in_user, 0);
+                lock_kernel_at(tf->tf_trapno == T_SYSCALL
+                               ? LOCKSTAT_SYSCALL(tf->tf_regs.reg_eax)
+                               : LOCKSTAT_TRAP(tf->tf_trapno));
+                // Other CPUs no longer wait for our shootdown IPI
+                // handler once we are here, so catch up first.
+                tlb_shootdown_recv();
 
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
 			env_free(curenv);
-			curenv = NULL;
+			cpu_set_curenv(NULL);
 			sched_yield();
 		}
 
@@ -385,10 +427,13 @@ trap(struct Trapframe *tf)
 
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
-	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNING)
+	// if doing so makes sense, and if nothing that woke up during
+	// the trap should run first.
+	if (curenv && curenv->env_status == ENV_RUNNING) {
+		if (thiscpu->cpu_resched)
+			sched_tick();
 		env_run(curenv);
-	else
+	} else
 		sched_yield();
 }
 
@@ -412,6 +457,12 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// Writes to copy-on-write pages are resolved right here, without
+	// bothering the environment's upcall.
+	if ((tf->tf_err & FEC_WR)
+	    && page_cow_fault(curenv->env_pgdir, (void *) fault_va) == 0)
+		env_run(curenv);
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
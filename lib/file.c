@@ -1,11 +1,20 @@
 #include <inc/fs.h>
 #include <inc/string.h>
+#include <inc/x86.h>
 #include <inc/lib.h>
 
 #define debug 0
 
+// Request channel shared with the file server, just below the file
+// descriptor table.
+#define FSCHAN		((struct Fschan *) 0xCFFFF000)
+
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+static envid_t fsenv;
+static envid_t fschan_env;	// Env whose channel is mapped at FSCHAN
+static envid_t fschan_failed;	// Env that could not set one up
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,8 +24,6 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-
 	if (fsenv == 0) {
 		fsenv = ipc_find_env(ENV_TYPE_FS);
         }
@@ -26,8 +33,97 @@ fsipc(unsigned type, void *dstva)
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U,
+			dstva, NULL);
+}
+
+// Like fsipc, but for requests that fit in IPC message words: the
+// 'size'-byte request at 'req' is copied by the kernel and no page
+// is mapped into the file server.
+static int
+fsipc_msg(unsigned type, const void *req, size_t size)
+{
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	if (debug)
+		cprintf("[%08x] fsipc_msg %d %08x\n", thisenv->env_id, type, *(uint32_t *)req);
+
+	return ipc_call(fsenv, type, (void *) req,
+			IPC_PERM_MSG(ROUNDUP(size, 4) / 4), NULL, NULL);
+}
+
+// Set up this env's request channel with the file server, once.
+// The page is PTE_SHARE so that fork does not make it copy-on-write
+// under the server; a child sets up its own channel when it first
+// opens a file, and until then uses plain IPC.
+static void
+fschan_setup(void)
+{
+	if (fschan_env == thisenv->env_id || fschan_failed == thisenv->env_id)
+		return;
+	if (sys_page_alloc(0, FSCHAN, PTE_P|PTE_U|PTE_W|PTE_SHARE) < 0 ||
+	    ipc_call(fsenv, FSREQ_CHANNEL, FSCHAN, PTE_P|PTE_U|PTE_W,
+		     NULL, NULL) < 0) {
+		sys_page_unmap(0, FSCHAN);
+		fschan_failed = thisenv->env_id;
+		return;
+	}
+	fschan_env = thisenv->env_id;
+}
+
+// Read or write (per 'type') up to 'n' bytes at fd's seek position
+// through the request channel, split into as many FSCHAN_DATASIZE
+// requests as fit in the ring, posted in one batch.  Rings the
+// doorbell and sleeps until the server has handled them.
+// Returns the number of bytes transferred, or < 0 on error.
+static ssize_t
+fschan_rw(int type, struct Fd *fd, void *buf, size_t n)
+{
+	struct Fschan *ch = FSCHAN;
+	struct Fschan_sqe *sqe;
+	uint32_t first = ch->ch_sq_prod, i, k, nreq;
+	size_t done, m;
+	int r;
+
+	for (nreq = 0, done = 0; nreq < FSCHAN_NSLOT && done < n;
+	     nreq++, done += m) {
+		i = (first + nreq) % FSCHAN_NSLOT;
+		m = MIN(n - done, FSCHAN_DATASIZE);
+		sqe = &ch->ch_sq[i];
+		sqe->sqe_type = type;
+		sqe->sqe_fileid = fd->fd_file.id;
+		sqe->sqe_n = m;
+		sqe->sqe_linked = nreq > 0;
+		if (type == FSREQ_WRITE)
+			memmove(ch->ch_data[i], buf + done, m);
+	}
+
+	// A polling server finds the batch without a doorbell.  It
+	// clears ch_polling before its last scan, so once we see it
+	// clear, either that scan takes the batch or we ring.  The
+	// server drains the channels before it replies to a doorbell,
+	// so one call normally covers the whole batch.
+	xchg(&ch->ch_sq_prod, first + nreq);
+	while (ch->ch_cq_prod != first + nreq) {
+		if (ch->ch_polling)
+			sys_yield();
+		else if ((r = ipc_call(fsenv, FSREQ_DOORBELL, NULL, 0,
+				       NULL, NULL)) < 0)
+			return r;
+	}
+
+	for (k = 0, done = 0; k < nreq; k++) {
+		i = (first + k) % FSCHAN_NSLOT;
+		if ((r = ch->ch_cq[i]) < 0)
+			return done ? done : r;
+		if (type == FSREQ_READ)
+			memmove(buf + done, ch->ch_data[i], r);
+		done += r;
+		if (r < ch->ch_sq[i].sqe_n)
+			break;
+	}
+	return done;
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -87,6 +183,7 @@ open(const char *path, int mode)
 		return r;
 	}
 
+	fschan_setup();
 	return fd2num(fd);
 }
 
@@ -101,8 +198,11 @@ open(const char *path, int mode)
 static int
 devfile_flush(struct Fd *fd)
 {
-	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	struct Fsreq_flush req;
+
+	static_assert(sizeof(req) <= IPC_MSG_WORDS * 4);
+	req.req_fileid = fd->fd_file.id;
+	return fsipc_msg(FSREQ_FLUSH, &req, sizeof(req));
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
@@ -119,6 +219,9 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// system server.
 	int r;
 
+	if (fschan_env == thisenv->env_id)
+		return fschan_rw(FSREQ_READ, fd, buf, n);
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
@@ -146,6 +249,10 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
         int r;
         int buf_size;
 
+        if (fschan_env == thisenv->env_id) {
+            return fschan_rw(FSREQ_WRITE, fd, (void *) buf, n);
+        }
+
         fsipcbuf.write.req_fileid = fd->fd_file.id;
         fsipcbuf.write.req_n = n;
         buf_size = PGSIZE - (sizeof(int) + sizeof(size_t));
@@ -176,9 +283,12 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 static int
 devfile_trunc(struct Fd *fd, off_t newsize)
 {
-	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
-	fsipcbuf.set_size.req_size = newsize;
-	return fsipc(FSREQ_SET_SIZE, NULL);
+	struct Fsreq_set_size req;
+
+	static_assert(sizeof(req) <= IPC_MSG_WORDS * 4);
+	req.req_fileid = fd->fd_file.id;
+	req.req_size = newsize;
+	return fsipc_msg(FSREQ_SET_SIZE, &req, sizeof(req));
 }
 
 
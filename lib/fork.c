@@ -4,8 +4,8 @@
 #include <inc/lib.h>
 
 // PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
+// It is one of the bits explicitly allocated to user processes (PTE_AVAIL),
+// defined in inc/mmu.h so that sys_fork can set it too.
 
 //
 // Custom page fault handler - if faulting page is copy-on-write,
@@ -27,7 +27,9 @@ pgfault(struct UTrapframe *utf)
 	// LAB 4: Your code here.
         if ((err & FEC_WR) == 0) { panic("pgfault access is not write"); }
 
-        if ((uvpd[PDX(addr)] & PTE_P) == 0 || (uvpt[PGNUM(addr)] & PTE_COW) == 0) {
+        // (4MB pages are never copy-on-write, and have no uvpt entries)
+        if ((uvpd[PDX(addr)] & PTE_P) == 0 || (uvpd[PDX(addr)] & PTE_PS) ||
+            (uvpt[PGNUM(addr)] & PTE_COW) == 0) {
            panic("The pgfault can not be handled due to access limit\n");
         }
 
@@ -88,6 +90,76 @@ duppage(envid_t envid, unsigned pn)
         return sys_page_map(0, addr, envid, addr, perm);
 }
 
+//
+// Copy 'len' bytes at addr into fresh pages of the child envid, mapped
+// with 'perm' (PTE_PS for a single 4MB page), through UTEMP.
+//
+static int
+copypages(envid_t envid, uintptr_t addr, size_t len, int perm)
+{
+        size_t step = (perm & PTE_PS) ? PTSIZE : PGSIZE;
+        uintptr_t va;
+        int r;
+
+        for (va = addr; va < addr + len; va += step) {
+            if ((r = sys_page_alloc(envid, (void *) va, perm | PTE_W)) < 0) {
+                return r;
+            }
+            if ((r = sys_page_map(envid, (void *) va, 0, UTEMP, perm | PTE_W)) < 0) {
+                return r;
+            }
+            memmove(UTEMP, (void *) va, step);
+            if ((r = sys_page_unmap(0, UTEMP)) < 0) { return r; }
+            // the child gets no more access than we have
+            if (!(perm & PTE_W) &&
+                (r = sys_page_map(envid, (void *) va, envid, (void *) va, perm)) < 0) {
+                return r;
+            }
+        }
+        return 0;
+}
+
+//
+// Give the child envid its own copy of the 4MB page at addr, or share
+// it if it is PTE_SHARE.  Large pages are not copy-on-write: a fault
+// would have to copy 4MB anyway, so copy them up front through UTEMP.
+// If the kernel cannot map 4MB pages, the copy is made of 4KB pages.
+//
+static int
+duplargepage(envid_t envid, uintptr_t addr)
+{
+        int r;
+        int perm = (uvpd[PDX(addr)] & PTE_SYSCALL) | PTE_PS;
+
+        if (perm & PTE_SHARE) {
+            return sys_page_map(0, (void *) addr, envid, (void *) addr, perm);
+        }
+        r = copypages(envid, addr, PTSIZE, perm);
+        if (r == -E_INVAL) {
+            r = copypages(envid, addr, PTSIZE, perm & ~PTE_PS);
+        }
+        return r;
+}
+
+//
+// Fork with copy-on-write.  The kernel copies the address space in one
+// sys_fork call; ufork below does the same a page at a time from user
+// space, and is used if the kernel does not know sys_fork.
+//
+envid_t
+fork(void)
+{
+        envid_t envid;
+
+        set_pgfault_handler(pgfault);
+        envid = sys_fork();
+        if (envid == -E_INVAL) { return ufork(); }
+        if (envid == 0) {
+            thisenv = &envs[ENVX(sys_getenvid())];
+        }
+        return envid;
+}
+
 //
 // User-level fork with copy-on-write.
 // Set up our page fault handler appropriately.
@@ -105,7 +177,7 @@ duppage(envid_t envid, unsigned pn)
 //   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
-fork(void)
+ufork(void)
 {
 	// LAB 4: Your code here.
         struct Env *childenv;
@@ -126,6 +198,13 @@ fork(void)
 
         // We are the parent
         for (addr = UTEXT; addr < UTOP - PGSIZE; addr+=PGSIZE) {
+            if (uvpd[PDX(addr)] & PTE_PS) {
+                if ((r = duplargepage(envid, addr)) < 0) {
+                    panic("duplargepage(): %e\n", r);
+                }
+                addr += PTSIZE - PGSIZE;
+                continue;
+            }
             if ((uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_U)) {
                 if ((r = duppage(envid, PGNUM(addr))) < 0) {
                     panic("duppage(): duppage failed\n");
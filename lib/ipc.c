@@ -12,6 +12,11 @@
 //	transferred to 'pg').
 // If the system call fails, then store 0 in *fromenv and *perm (if
 //	they're nonnull) and return the error.
+// Message words sent instead of a page are left in
+//	thisenv->env_ipc_msg (thisenv->env_ipc_msglen of them).
+// If this env has a message ring with entries in it, nothing is
+//	received: *from_env_store is set to 0 and 0 is returned, so the
+//	caller can drain the ring with ipc_ring_peek/ipc_ring_pop.
 // Otherwise, return the value sent by the sender
 //
 // Hint:
@@ -29,24 +34,29 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
         else { r = sys_ipc_recv((void *)UTOP); }
             
         if (from_env_store) { 
-            *from_env_store = r < 0 ? 0 : thisenv->env_ipc_from; 
+            *from_env_store = r != 0 ? 0 : thisenv->env_ipc_from; 
         }
         if (perm_store) { 
-            *perm_store = r < 0 ? 0 : thisenv->env_ipc_perm; 
+            *perm_store = r != 0 ? 0 : thisenv->env_ipc_perm; 
         }
 
         if (r < 0) { return r; }
+        if (r > 0) { return 0; }
         
         return thisenv->env_ipc_value;
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function blocks in the kernel until 'toenv' receives the
+// message; concurrent senders are served in FIFO order.
+// Errors are ignored.  Use sys_ipc_try_send directly to fail with
+// -E_IPC_NOT_RECV instead of waiting.
+// If 'perm' is IPC_PERM_MSG(n), 'pg' points to n message words that
+// are copied to the receiver instead of sharing a page; the same goes
+// for ipc_call and ipc_reply_recv.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
+//   If 'pg' is null, pass sys_ipc_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
@@ -57,12 +67,135 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 
         if (!pg) { srcva = (void *) UTOP; }
 
-        while ((r = sys_ipc_try_send(to_env, val, srcva, perm)) == -E_IPC_NOT_RECV) {
-            sys_yield();
-        }
+        r = sys_ipc_send(to_env, val, srcva, perm);
         if (r < 0) { return; } //panic("ipc_send(): ipc send error\n"); }
 }
 
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env' and
+// wait for its reply, in a single system call.  Only 'to_env' can answer;
+// other senders wait until the reply has arrived.
+// 'rcv_pg' and 'perm_store' are as for ipc_recv.
+// Returns the reply value, or < 0 if the send or receive failed
+// (in which case *perm_store is 0).
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	r = sys_ipc_call(to_env, val, pg ? pg : (void *) UTOP, perm,
+			 rcv_pg ? rcv_pg : (void *) UTOP);
+	if (perm_store)
+		*perm_store = r < 0 ? 0 : thisenv->env_ipc_perm;
+	if (r < 0)
+		return r;
+	return thisenv->env_ipc_value;
+}
+
+// Reply to 'to_env' with 'val' (and 'pg' with 'perm', if 'pg' is nonnull)
+// and wait for the next request from anyone, in a single system call.
+// If 'to_env' is 0, only waits.  The remaining arguments and the return
+// value are as for ipc_recv.
+int32_t
+ipc_reply_recv(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	r = sys_ipc_reply_wait(to_env, val, pg ? pg : (void *) UTOP, perm,
+			       rcv_pg ? rcv_pg : (void *) UTOP);
+	if (from_env_store)
+		*from_env_store = r != 0 ? 0 : thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = r != 0 ? 0 : thisenv->env_ipc_perm;
+	if (r < 0)
+		return r;
+	if (r > 0)
+		return 0;
+	return thisenv->env_ipc_value;
+}
+
+// Receive a message from the first ready one of the 'n' sources in
+// 'srcs', which are in priority order (see sys_ipc_select); wait if
+// none is ready.  'pg', 'from_env_store' and 'perm_store' are as for
+// ipc_recv, and the return value is the value received.
+// If 'ready_store' is nonnull, the bits (1 << i) of the sources that
+// were ready are stored there; the one received from is always among
+// them.  If that one is IPC_SRC_RING, nothing is received
+// (*from_env_store is 0): drain the ring with ipc_ring_peek.
+int32_t
+ipc_select(const envid_t *srcs, int n, void *pg, envid_t *from_env_store,
+	   int *perm_store, uint32_t *ready_store)
+{
+	envid_t from;
+	int r, i;
+
+	r = sys_ipc_select(srcs, n, pg ? pg : (void *) UTOP);
+	if (r < 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		if (ready_store)
+			*ready_store = 0;
+		return r;
+	}
+
+	// Woken by a send: find the source it came from.
+	from = thisenv->env_ipc_from;
+	if (r == 0) {
+		for (i = 0; i < n - 1; i++)
+			if (srcs[i] == 0 || srcs[i] == from)
+				break;
+		r = 1 << i;
+	}
+
+	// Received nothing if the first ready source was the ring.
+	for (i = 0; !(r & (1 << i)); i++)
+		;
+	if (srcs[i] == IPC_SRC_RING)
+		from = 0;
+
+	if (from_env_store)
+		*from_env_store = from;
+	if (perm_store)
+		*perm_store = from ? thisenv->env_ipc_perm : 0;
+	if (ready_store)
+		*ready_store = r;
+	return from ? thisenv->env_ipc_value : 0;
+}
+
+// Allocate a page at 'ring' and make it this env's message ring, with
+// pages sent through it mapped starting at 'pgva' (NULL: no pages).
+// Returns 0 on success, < 0 on error.
+int
+ipc_ring_init(struct IpcRing *ring, void *pgva)
+{
+	int r;
+
+	if ((r = sys_page_alloc(0, ring, PTE_P | PTE_U | PTE_W)) < 0)
+		return r;
+	return sys_ipc_ring(ring, pgva ? pgva : (void *) UTOP);
+}
+
+// Return the oldest entry in 'ring', or NULL if it is empty.
+// The entry, and any page mapped at its ire_va, remain valid until
+// ipc_ring_pop.
+struct IpcRingEntry *
+ipc_ring_peek(struct IpcRing *ring)
+{
+	if (ring->ir_tail == ring->ir_head)
+		return NULL;
+	return &ring->ir_ent[ring->ir_tail % IPC_RING_SIZE];
+}
+
+// Release the oldest entry in 'ring' back to the senders.
+void
+ipc_ring_pop(struct IpcRing *ring)
+{
+	ring->ir_tail++;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
@@ -8,6 +8,8 @@
 #define REQVA		0x0ffff000
 union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
+static envid_t nsenv;
+
 // Send an IP request to the network server, and wait for a reply.
 // The request body should be in nsipcbuf, and parts of the response
 // may be written back to nsipcbuf.
@@ -16,7 +18,6 @@ union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 nsipc(unsigned type)
 {
-	static envid_t nsenv;
 	if (nsenv == 0)
 		nsenv = ipc_find_env(ENV_TYPE_NS);
 
@@ -25,8 +26,23 @@ nsipc(unsigned type)
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-	return ipc_recv(NULL, NULL, NULL);
+	return ipc_call(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U, NULL, NULL);
+}
+
+// Like nsipc, but for requests that fit in IPC message words: the
+// 'size'-byte request at 'req' is copied by the kernel and no page
+// is mapped into the network server.
+static int
+nsipc_msg(unsigned type, const void *req, size_t size)
+{
+	if (nsenv == 0)
+		nsenv = ipc_find_env(ENV_TYPE_NS);
+
+	if (debug)
+		cprintf("[%08x] nsipc_msg %d\n", thisenv->env_id, type);
+
+	return ipc_call(nsenv, type, (void *) req,
+			IPC_PERM_MSG(ROUNDUP(size, 4) / 4), NULL, NULL);
 }
 
 int
@@ -64,8 +80,11 @@ nsipc_shutdown(int s, int how)
 int
 nsipc_close(int s)
 {
-	nsipcbuf.close.req_s = s;
-	return nsipc(NSREQ_CLOSE);
+	struct Nsreq_close req;
+
+	static_assert(sizeof(req) <= IPC_MSG_WORDS * 4);
+	req.req_s = s;
+	return nsipc_msg(NSREQ_CLOSE, &req, sizeof(req));
 }
 
 int
@@ -80,9 +99,12 @@ nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen)
 int
 nsipc_listen(int s, int backlog)
 {
-	nsipcbuf.listen.req_s = s;
-	nsipcbuf.listen.req_backlog = backlog;
-	return nsipc(NSREQ_LISTEN);
+	struct Nsreq_listen req;
+
+	static_assert(sizeof(req) <= IPC_MSG_WORDS * 4);
+	req.req_s = s;
+	req.req_backlog = backlog;
+	return nsipc_msg(NSREQ_LISTEN, &req, sizeof(req));
 }
 
 int
@@ -1,9 +1,16 @@
 #include <inc/lib.h>
 
+// Waits until 'nsec' nanoseconds have passed.
+void
+nsleep(uint64_t nsec)
+{
+    uint64_t end = sys_time_nsec() + nsec;
+    while (sys_time_nsec() < end) {}
+}
+
 // Waits until exits.
 void
 sleep(int interval)
 { 
-    int end = interval + sys_time_msec();
-    while (sys_time_msec() < end) {}
+    nsleep((uint64_t) interval * 1000000);
 }
@@ -11,6 +11,11 @@ static int map_segment(envid_t child, uintptr_t va, size_t memsz,
 		       int fd, size_t filesz, off_t fileoffset, int perm);
 static int copy_shared_pages(envid_t child);
 
+// Page operations on the child not yet sent to the kernel; see
+// page_op_add and page_op_flush.
+static struct PageOp page_ops[PAGE_BATCH_MAX];
+static int npage_ops;
+
 // Spawn a child process from a program image loaded from the file system.
 // prog: the pathname of the program to run.
 // argv: pointer to null-terminated array of pointers to strings,
@@ -138,6 +143,7 @@ spawn(const char *prog, const char **argv)
 	return child;
 
 error:
+	npage_ops = 0;
 	sys_env_destroy(child);
 	close(fd);
 	return r;
@@ -259,6 +265,44 @@ error:
 	return r;
 }
 
+// Send the queued page operations to the kernel in one sys_page_batch
+// call.  Returns the first failed entry's error, if any.
+static int
+page_op_flush(void)
+{
+	int i, n = npage_ops, r;
+
+	npage_ops = 0;
+	if (n == 0 || (r = sys_page_batch(page_ops, n)) == 0)
+		return 0;
+	if (r < 0)
+		return r;
+	for (i = 0; i < n; i++)
+		if (page_ops[i].po_result < 0)
+			return page_ops[i].po_result;
+	return -E_UNSPECIFIED;
+}
+
+// Queue a page operation (see struct PageOp), flushing the queue
+// first if it is full.
+static int
+page_op_add(int op, void *srcva, envid_t dstenv, void *dstva, int perm)
+{
+	struct PageOp *po;
+	int r;
+
+	if (npage_ops == PAGE_BATCH_MAX && (r = page_op_flush()) < 0)
+		return r;
+	po = &page_ops[npage_ops++];
+	po->po_op = op;
+	po->po_srcenv = 0;
+	po->po_srcva = srcva;
+	po->po_dstenv = dstenv;
+	po->po_dstva = dstva;
+	po->po_perm = perm;
+	return 0;
+}
+
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
@@ -278,7 +322,8 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 	for (i = 0; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
 			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
+			if ((r = page_op_add(PAGE_OP_ALLOC, NULL, child,
+					     (void*) (va + i), perm)) < 0)
 				return r;
 		} else {
 			// from file
@@ -293,7 +338,7 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 			sys_page_unmap(0, UTEMP);
 		}
 	}
-	return 0;
+	return page_op_flush();
 }
 
 // Copy the mappings for shared pages into the child address space.
@@ -310,20 +355,35 @@ copy_shared_pages(envid_t child)
                 pn += NPTENTRIES;
                 continue;
             }
+            // a 4MB page is shared whole (there are none unless the
+            // kernel supports them, so this needs no 4KB fallback)
+            if (uvpd[pdeno] & PTE_PS) {
+                if (uvpd[pdeno] & PTE_SHARE) {
+                    void *addr = (void *) (pn << PGSHIFT);
+                    r = page_op_add(PAGE_OP_MAP, addr, child, addr,
+                                    (uvpd[pdeno] & PTE_SYSCALL) | PTE_PS);
+                    if (r) {
+                        return r;
+                    }
+                }
+                pn += NPTENTRIES;
+                continue;
+            }
 
             for (pteno = 0; pteno < NPTENTRIES; pteno++, pn++) {
                 if (uvpt[pn] == 0)
                     continue;
                 if (uvpt[pn] & PTE_SHARE) {
                     void *addr = (void *) (pn << PGSHIFT);
-                    r = sys_page_map(0, addr, child, addr, uvpt[pn]&PTE_SYSCALL);
+                    r = page_op_add(PAGE_OP_MAP, addr, child, addr,
+                                    uvpt[pn]&PTE_SYSCALL);
                     if (r) {
                         return r;
                     }
                 }
             }
         }
-        return 0;
+        return page_op_flush();
 
 }
 
@@ -15,7 +15,7 @@ input(envid_t ns_envid)
 	// Hint: When you IPC a page to the network server, it will be
 	// reading from it for a while, so don't immediately receive
 	// another packet in to the same physical page.
-        int r, len, perm;
+        int r, len;
         char data[RX_BUFSIZE];
 
         while (1) {
@@ -23,14 +23,22 @@ input(envid_t ns_envid)
           
             if (r < 0) { continue; }
 
+            // The network server keeps each packet page mapped in its
+            // input ring until it has been processed, so every packet
+            // gets a fresh page.
+            if ((r = sys_page_alloc(0, &nsipcbuf, PTE_P|PTE_W|PTE_U)) < 0) {
+                panic("input: sys_page_alloc: %e", r);
+            }
             nsipcbuf.pkt.jp_len = len;
             memmove((void *)nsipcbuf.pkt.jp_data, (void *)data, len);
 
+            // Queued in the server's message ring; only wait if the
+            // ring is full.
             while((r = sys_ipc_try_send(ns_envid, NSREQ_INPUT, 
-                                      &nsipcbuf, PTE_SYSCALL)) < 0) 
-            {}
-
-            sleep(1);
+                                      &nsipcbuf, PTE_P|PTE_W|PTE_U)) < 0) 
+            {
+                sys_yield();
+            }
         }
 
 }
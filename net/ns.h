@@ -11,6 +11,11 @@
 #define QUEUE_SIZE	20
 #define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
 
+// Message ring through which the input env sends packets, and the
+// pages those packets are mapped at.
+#define INRING		((struct IpcRing *) (REQVA - PGSIZE))
+#define INPKTVA		((void *) INRING - IPC_RING_SIZE * PGSIZE)
+
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
 
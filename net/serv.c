@@ -181,6 +181,7 @@ struct st_args {
 	int32_t reqno;
 	uint32_t whom;
 	union Nsipc *req;
+	uint32_t msg[IPC_MSG_WORDS];	// Request sent as IPC message words
 };
 
 static void
@@ -249,20 +250,53 @@ serve_thread(uint32_t a) {
 	if (args->reqno != NSREQ_INPUT)
 		ipc_send(args->whom, r, 0, 0);
 
-	put_buffer(args->req);
-	sys_page_unmap(0, (void*) args->req);
+	if (args->req != (union Nsipc *) args->msg) {
+		put_buffer(args->req);
+		sys_page_unmap(0, (void*) args->req);
+	}
 	free(args);
 }
 
+// IPC sources the server waits on, in priority order.
+enum { SRC_TIMER, SRC_INPUT, SRC_CLIENT, NSRC };
+
+// Hand every packet queued in the input ring to lwIP.
+static void
+serve_input_ring(void)
+{
+	struct IpcRingEntry *ent;
+
+	while ((ent = ipc_ring_peek(INRING))) {
+		if (ent->ire_value == NSREQ_INPUT && ent->ire_va)
+			jif_input(&nif, ent->ire_va);
+		else
+			cprintf("Invalid ring request %d from %08x\n",
+				ent->ire_value, ent->ire_from);
+		ipc_ring_pop(INRING);
+	}
+}
+
 void
 serve(void) {
 	int32_t reqno;
 	uint32_t whom;
-	int i, perm;
+	int i, r, perm, msglen;
+	uint32_t ready;
+	envid_t srcs[NSRC];
 	void *va;
 
+	// The input env queues packets here without waiting for us.
+	if ((r = ipc_ring_init(INRING, INPKTVA)) < 0)
+		panic("ipc_ring_init: %e", r);
+
+	// Timer ticks first, then packet input, then client requests,
+	// so a flood of packets or clients cannot hold off the timers.
+	srcs[SRC_TIMER] = timer_envid;
+	srcs[SRC_INPUT] = IPC_SRC_RING;
+	srcs[SRC_CLIENT] = 0;
+
 	while (1) {
-		// ipc_recv will block the entire process, so we flush
+		// ipc_select will block the entire process, so we flush
 		// all pending work from other threads.  We limit the
 		// number of yields in case there's a rogue thread.
 		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
@@ -270,22 +304,39 @@ serve(void) {
 
 		perm = 0;
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		reqno = ipc_select(srcs, NSRC, (void *) va,
+				   (envid_t *) &whom, &perm, &ready);
 		if (debug) {
-			cprintf("ns req %d from %08x\n", reqno, whom);
+			cprintf("ns req %d from %08x ready %x\n",
+				reqno, whom, ready);
 		}
 
 		// first take care of requests that do not contain an argument page
-		if (reqno == NSREQ_TIMER) {
+		if (whom && reqno == NSREQ_TIMER) {
 			process_timer(whom);
+			whom = 0;
+		}
+
+		// Then everything queued in the input ring.
+		if (ready & (1 << SRC_INPUT))
+			serve_input_ring();
+
+		if (whom == 0) {
 			put_buffer(va);
 			continue;
 		}
 
-		// All remaining requests must contain an argument page
+		// Small requests come as IPC message words; all remaining
+		// requests must contain an argument page
+		msglen = 0;
 		if (!(perm & PTE_P)) {
-			cprintf("Invalid request from %08x: no argument page\n", whom);
-			continue; // just leave it hanging...
+			if ((reqno != NSREQ_CLOSE && reqno != NSREQ_LISTEN) ||
+			    thisenv->env_ipc_msglen == 0) {
+				cprintf("Invalid request from %08x: no argument page\n", whom);
+				continue; // just leave it hanging...
+			}
+			msglen = thisenv->env_ipc_msglen;
+			put_buffer(va);
 		}
 
 		// Since some lwIP socket calls will block, create a thread and
@@ -297,6 +348,12 @@ serve(void) {
 		args->reqno = reqno;
 		args->whom = whom;
 		args->req = va;
+		if (msglen) {
+			memset(args->msg, 0, sizeof(args->msg));
+			memmove(args->msg, (void *) thisenv->env_ipc_msg,
+				msglen * sizeof(uint32_t));
+			args->req = (union Nsipc *) args->msg;
+		}
 
 		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
 		thread_yield(); // let the thread created run
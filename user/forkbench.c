@@ -0,0 +1,45 @@
+// Time fork, which copies the address space in one sys_fork call,
+// against ufork, which does it a page at a time from user space,
+// in an environment with a 4MB heap.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define HEAP	((char *) 0x10000000)
+#define NFORKS	20
+
+static uint32_t
+time_fork(envid_t (*forkfn)(void))
+{
+	uint64_t start, cycles = 0;
+	envid_t who;
+	int i;
+
+	for (i = 0; i < NFORKS; i++) {
+		start = read_tsc();
+		if ((who = forkfn()) < 0)
+			panic("forkbench: fork: %e", who);
+		if (who == 0)
+			exit();
+		cycles += read_tsc() - start;
+		wait(who);
+	}
+	return cycles / NFORKS;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t kcycles, ucycles;
+	char *va;
+	int r;
+
+	for (va = HEAP; va < HEAP + PTSIZE; va += PGSIZE)
+		if ((r = sys_page_alloc(0, va, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("forkbench: sys_page_alloc: %e", r);
+
+	kcycles = time_fork(fork);
+	ucycles = time_fork(ufork);
+	cprintf("forkbench: fork %u cycles, ufork %u cycles\n",
+		kcycles, ucycles);
+}
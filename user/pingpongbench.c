@@ -0,0 +1,44 @@
+// Time IPC round trips between two processes.
+// Every round trip is two context switches, so this mostly measures
+// what a switch costs, including refilling the TLB afterwards.
+// Compare 'make run-pingpongbench' against
+// 'make DEFS=-DNO_PGE run-pingpongbench' to see what global kernel
+// pages save.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS	10000
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint64_t start, cycles;
+	uint32_t i;
+
+	if ((who = fork()) == 0) {
+		// child: bounce every value back until the last one
+		while (1) {
+			i = ipc_recv(&who, 0, 0);
+			ipc_send(who, i, 0, 0);
+			if (i == NROUNDS - 1)
+				return;
+		}
+	}
+
+	// warm up
+	ipc_send(who, 0, 0, 0);
+	ipc_recv(0, 0, 0);
+
+	start = read_tsc();
+	for (i = 1; i < NROUNDS; i++) {
+		ipc_send(who, i, 0, 0);
+		if (ipc_recv(0, 0, 0) != i)
+			panic("pingpongbench: lost round %d", i);
+	}
+	cycles = read_tsc() - start;
+
+	cprintf("pingpongbench: %d round trips, %u cycles each\n",
+		NROUNDS - 1, (uint32_t) (cycles / (NROUNDS - 1)));
+}
@@ -0,0 +1,66 @@
+// Two CPU-bound children at different priorities share one CPU.
+// The weighted-fair scheduler should give the priority 0 child about
+// three times the CPU time of the priority 5 one (weights 1024 : 335).
+
+#include <inc/lib.h>
+
+#define RUNMSEC		1000
+#define LOPRIO		5
+
+// Count loop iterations from 'start' until RUNMSEC later.
+static uint32_t
+spin(uint32_t start)
+{
+	uint32_t n = 0;
+
+	while (sys_time_msec() < start)
+		sys_yield();
+	while (sys_time_msec() < start + RUNMSEC)
+		n++;
+	return n;
+}
+
+static envid_t
+spawn_spinner(void)
+{
+	envid_t who;
+
+	if ((who = fork()) < 0)
+		panic("prioshare: fork: %e", who);
+	if (who == 0) {
+		ipc_send(thisenv->env_parent_id, spin(ipc_recv(0, 0, 0)), 0, 0);
+		exit();
+	}
+	return who;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t hi, lo, who;
+	uint32_t start, n, nhi = 0, nlo = 0;
+	int i, r;
+
+	hi = spawn_spinner();
+	lo = spawn_spinner();
+	if ((r = sys_env_set_priority(lo, LOPRIO)) < 0)
+		panic("prioshare: sys_env_set_priority: %e", r);
+
+	// Both start at the same time, a little from now.
+	start = sys_time_msec() + 100;
+	ipc_send(hi, start, 0, 0);
+	ipc_send(lo, start, 0, 0);
+	for (i = 0; i < 2; i++) {
+		n = ipc_recv(&who, 0, 0);
+		if (who == hi)
+			nhi = n;
+		else if (who == lo)
+			nlo = n;
+	}
+
+	cprintf("prioshare: priority 0 ran %u loops, priority %d ran %u\n",
+		nhi, LOPRIO, nlo);
+	if (nhi < 2 * nlo)
+		panic("prioshare: priority 0 got less than twice the CPU");
+	cprintf("prioshare: OK\n");
+}
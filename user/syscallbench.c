@@ -0,0 +1,65 @@
+// Measure system call throughput as more processes make calls at once.
+// Run it with different CPUS= settings: calls that take the big kernel
+// lock stop scaling at one CPU's worth, lock-free ones keep going.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALLS		20000
+#define MAXWORKERS	8
+
+// Make NCALLS system calls of one kind and return the cycles taken.
+static uint32_t
+run_calls(bool locked)
+{
+	uint64_t start = read_tsc();
+	int i;
+
+	for (i = 0; i < NCALLS; i++)
+		if (locked)
+			sys_page_unmap(0, UTEMP);
+		else
+			sys_getenvid();
+	return read_tsc() - start;
+}
+
+// Start 'nworkers' processes making calls together, and return the
+// cycles per call across all of them.
+static uint32_t
+bench(int nworkers, bool locked)
+{
+	envid_t workers[MAXWORKERS];
+	uint32_t cycles, slowest = 0;
+	int i;
+
+	for (i = 0; i < nworkers; i++) {
+		if ((workers[i] = fork()) < 0)
+			panic("fork: %e", workers[i]);
+		if (workers[i] == 0) {
+			ipc_recv(0, 0, 0);
+			ipc_send(thisenv->env_parent_id, run_calls(locked), 0, 0);
+			exit();
+		}
+	}
+	for (i = 0; i < nworkers; i++)
+		ipc_send(workers[i], 0, 0, 0);
+	for (i = 0; i < nworkers; i++)
+		if ((cycles = ipc_recv(0, 0, 0)) > slowest)
+			slowest = cycles;
+	return slowest / (nworkers * NCALLS);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t unlocked, locked;
+	int n;
+
+	for (n = 1; n <= MAXWORKERS; n *= 2) {
+		unlocked = bench(n, 0);
+		locked = bench(n, 1);
+		cprintf("syscallbench: %d workers: sys_getenvid %u, "
+			"sys_page_unmap %u cycles per call\n",
+			n, unlocked, locked);
+	}
+}